@@ -0,0 +1,119 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <memory_resource>
+#include "program_options.hpp"
+#include "messages.hpp"
+#include "connections.hpp"
+#include "logging.hpp"
+#include "game.hpp"
+#include "alloc_check.hpp"
+
+// Plays a game of random actions through the server's turn processing
+// and the client's GUI board, with the allocation budgets of the game
+// handler and of the client's Turn handling, and fails if either goes
+// over its budget. Takes the options of the server, `make check` runs
+// it with some.
+
+#ifndef ALLOC_CHECK
+#error "alloc-test counts allocations, build it with -DALLOC_CHECK"
+#endif
+
+namespace {
+  ClientToServer random_action(std::minstd_rand &random) {
+    ClientToServer action;
+    // Robots mostly move, so that blocks do not fill the board.
+    switch (random() % 8) {
+      case 0:
+        action.type = ClientToServerType::PlaceBomb;
+        break;
+      case 1:
+        action.type = ClientToServerType::PlaceBlock;
+        break;
+      default:
+        action.type = ClientToServerType::Move;
+        action.direction = Direction(random() % 4);
+    }
+    return action;
+  }
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  ServerOptions options(argc, argv);
+  Logger::set_level(options.log_level);
+  std::minstd_rand random(options.seed);
+
+  Game game(options);
+  std::vector<std::vector<Event>> turns(options.game_length + 1);
+  std::vector<Event> current_events;
+  std::vector<std::byte> turn_memory(Game::TURN_ARENA);
+  // The same budgets as the game handler's and the client's.
+  AllocationBudget game_allocations("Game turn", 0, 16);
+  AllocationBudget client_allocations("Turn", 0, 16);
+
+  ClientToGUI out;
+  out.type = ClientToGUIType::Game;
+  out.server_name = options.server_name;
+  out.player_count = options.players_count;
+  out.size_x = options.size_x;
+  out.size_y = options.size_y;
+  out.game_length = options.game_length;
+  out.explosion_radius = options.explosion_radius;
+  out.bomb_timer = options.bomb_timer;
+  out.blocks.resize(options.size_x, options.size_y);
+  for (uint8_t id = 0; id < options.players_count; id++) {
+    // As the server and the client do for joined players.
+    game.scores[id] = 0;
+    out.players[id] = Player("robot", "localhost:0");
+    out.scores[id] = 0;
+  }
+  out.clear_board();
+  out.reserve(ParseLimits(
+    options.players_count, options.size_x, options.size_y, options.bomb_timer
+  ));
+  Buffer frame;
+
+  game.start(current_events);
+  for (uint16_t turn = 0; turn <= options.game_length; turn++) {
+    // As the game handler keeps its turns in the log.
+    turns[turn] = std::move(current_events);
+    current_events.clear();
+    current_events.reserve(game.max_turn_events());
+
+    {
+      AllocationBudget::Run allocations(client_allocations);
+      out.explosions.clear();
+      out.apply_turn(turn, turns[turn]);
+      frame.clear();
+      out.serialize(frame);
+    }
+    if (out.state_hash() != game.hash()) {
+      std::cerr << "alloc-test: the boards differ after turn " << turn << "\n";
+      return EXIT_FAILURE;
+    }
+
+    if (turn == options.game_length)
+      break;
+    for (uint8_t id = 0; id < options.players_count; id++) {
+      game.inputs[id].action.store(
+        pack_input(random_action(random)),
+        std::memory_order_relaxed
+      );
+    }
+    AllocationBudget::Run allocations(game_allocations);
+    std::pmr::monotonic_buffer_resource arena(
+      turn_memory.data(), turn_memory.size()
+    );
+    game.process_turn(current_events, arena);
+    allocations.allow(Game::allocations(current_events));
+  }
+
+  Logger::flush();
+  if (game_allocations.overruns() != 0 || client_allocations.overruns() != 0) {
+    std::cerr << "alloc-test: turns went over their allocation budgets\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "alloc-test: " << options.game_length
+            << " turns within their allocation budgets\n";
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "alloc_check.hpp"
+
+#ifdef ALLOC_CHECK
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include "logging.hpp"
+
+namespace {
+  thread_local uint64_t allocations = 0;
+
+  void *allocate(size_t size) noexcept {
+    allocations++;
+    return std::malloc(size == 0 ? 1 : size);
+  }
+
+  void *allocate(size_t size, std::align_val_t alignment) noexcept {
+    allocations++;
+    size_t align = static_cast<size_t>(alignment);
+    // aligned_alloc takes only multiples of the alignment.
+    size = (std::max<size_t>(size, 1) + align - 1) & ~(align - 1);
+    return std::aligned_alloc(align, size);
+  }
+} // anonymous namespace
+
+uint64_t thread_allocations() {
+  return allocations;
+}
+
+AllocationBudget::Run::~Run() {
+  budget.record(count(), allowed);
+}
+
+void AllocationBudget::record(uint64_t made, uint64_t allowed) {
+  if (++runs <= warmup || made <= allowed)
+    return;
+  overrun_count++;
+  Logger::log(
+    LogLevel::Error,
+    "[Alloc] {} went over its budget: {} allocations in run {}, {} allowed",
+    what, made, runs, allowed
+  );
+}
+
+// Replaces every form of new and delete, array forms call these.
+void *operator new(size_t size) {
+  if (void *ptr = allocate(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  if (void *ptr = allocate(size, alignment))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new(
+  size_t size,
+  std::align_val_t alignment,
+  const std::nothrow_t&
+  ) noexcept {
+  return allocate(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(
+  void *ptr,
+  std::align_val_t,
+  const std::nothrow_t&
+  ) noexcept {
+  std::free(ptr);
+}
+
+#endif // ALLOC_CHECK
@@ -0,0 +1,92 @@
+#ifndef ALLOC_CHECK_HPP
+#define ALLOC_CHECK_HPP
+#include <cstdint>
+
+// Heap allocation checks for hot paths that should not allocate in the
+// steady state. Built in with `make clean && make ALLOC_CHECK=1`, the
+// global operator new then counts the allocations of every thread.
+// Otherwise budgets compile to nothing.
+
+#ifdef ALLOC_CHECK
+
+// Allocations made by the calling thread so far.
+uint64_t thread_allocations();
+
+// Allocation budget of a path run over and over, like a turn. Each run
+// after the first `warmup` ones, which fill caches and grow buffers,
+// may make `per_run` allocations and the ones it allows for its own
+// work. An error is logged for every run that makes more.
+class AllocationBudget {
+public:
+  // `what` must outlive the budget.
+  AllocationBudget(const char *what, uint64_t per_run, uint64_t warmup)
+  : what(what),
+    per_run(per_run),
+    warmup(warmup) {}
+
+  // Counts the allocations of the calling thread during its lifetime
+  // as one run.
+  class Run {
+  public:
+    explicit Run(AllocationBudget &budget)
+    : budget(budget),
+      allowed(budget.per_run),
+      start(thread_allocations()) {}
+
+    ~Run();
+
+    Run(const Run&) = delete;
+    Run& operator=(const Run&) = delete;
+
+    // Allows more allocations in this run, for work known to allocate.
+    void allow(uint64_t more) {
+      allowed += more;
+    }
+
+    uint64_t count() const {
+      return thread_allocations() - start;
+    }
+
+  private:
+    AllocationBudget &budget;
+    uint64_t allowed, start;
+  };
+
+  // How many runs went over the budget.
+  uint64_t overruns() const {
+    return overrun_count;
+  }
+
+private:
+  const char *what;
+  uint64_t per_run, warmup;
+  uint64_t runs{0}, overrun_count{0};
+
+  void record(uint64_t made, uint64_t allowed);
+};
+
+#else
+
+class AllocationBudget {
+public:
+  AllocationBudget(const char*, uint64_t, uint64_t) {}
+
+  class Run {
+  public:
+    explicit Run(AllocationBudget&) {}
+
+    void allow(uint64_t) {}
+
+    uint64_t count() const {
+      return 0;
+    }
+  };
+
+  uint64_t overruns() const {
+    return 0;
+  }
+};
+
+#endif // ALLOC_CHECK
+
+#endif // ALLOC_CHECK_HPP
@@ -0,0 +1,137 @@
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include "board.hpp"
+#include "messages.hpp"
+#include "zobrist.hpp"
+
+namespace {
+  constexpr uint64_t ALL = ~uint64_t(0);
+
+  // Returns the lowest set bit of `line` in [lo, hi], or `hi` if none is.
+  size_t first_set(const uint64_t *line, size_t lo, size_t hi) {
+    size_t word = lo / 64;
+    uint64_t bits = line[word] & (ALL << (lo % 64));
+    for (; word < hi / 64; bits = line[++word]) {
+      if (bits)
+        return word * 64 + (size_t) std::countr_zero(bits);
+    }
+    bits &= ALL >> (63 - hi % 64);
+    return bits ? word * 64 + (size_t) std::countr_zero(bits) : hi;
+  }
+
+  // Returns the highest set bit of `line` in [lo, hi], or `lo` if none is.
+  size_t last_set(const uint64_t *line, size_t lo, size_t hi) {
+    size_t word = hi / 64;
+    uint64_t bits = line[word] & (ALL >> (63 - hi % 64));
+    for (; word > lo / 64; bits = line[--word]) {
+      if (bits)
+        return word * 64 + 63 - (size_t) std::countl_zero(bits);
+    }
+    bits &= ALL << (lo % 64);
+    return bits ? word * 64 + 63 - (size_t) std::countl_zero(bits) : lo;
+  }
+}
+
+BlockBoard::BlockBoard(uint16_t size_x, uint16_t size_y) {
+  resize(size_x, size_y);
+}
+
+void BlockBoard::resize(uint16_t size_x, uint16_t size_y) {
+  this->size_x = size_x;
+  this->size_y = size_y;
+  row_words = (size_x + 63) / 64;
+  column_words = (size_y + 63) / 64;
+  rows.assign(size_y * row_words, 0);
+  columns.assign(size_x * column_words, 0);
+  occupied.assign(row_words, 0);
+  column_blocks.assign(size_x, 0);
+  count = 0;
+  blocks_hash = 0;
+}
+
+void BlockBoard::clear() {
+  std::fill(rows.begin(), rows.end(), 0);
+  std::fill(columns.begin(), columns.end(), 0);
+  std::fill(occupied.begin(), occupied.end(), 0);
+  std::fill(column_blocks.begin(), column_blocks.end(), 0);
+  count = 0;
+  blocks_hash = 0;
+}
+
+bool BlockBoard::inside(const Position &position) const {
+  return position.x < size_x && position.y < size_y;
+}
+
+bool BlockBoard::contains(const Position &position) const {
+  if (!inside(position))
+    return false;
+  uint64_t word = rows[position.y * row_words + position.x / 64];
+  return (word >> (position.x % 64)) & 1;
+}
+
+bool BlockBoard::insert(const Position &position) {
+  if (!inside(position) || contains(position))
+    return false;
+  rows[position.y * row_words + position.x / 64] |=
+    uint64_t(1) << (position.x % 64);
+  columns[position.x * column_words + position.y / 64] |=
+    uint64_t(1) << (position.y % 64);
+  if (column_blocks[position.x]++ == 0)
+    occupied[position.x / 64] |= uint64_t(1) << (position.x % 64);
+  count++;
+  blocks_hash ^= zobrist::block(position.x, position.y);
+  return true;
+}
+
+void BlockBoard::erase(const Position &position) {
+  if (!contains(position))
+    return;
+  rows[position.y * row_words + position.x / 64] &=
+    ~(uint64_t(1) << (position.x % 64));
+  columns[position.x * column_words + position.y / 64] &=
+    ~(uint64_t(1) << (position.y % 64));
+  if (--column_blocks[position.x] == 0)
+    occupied[position.x / 64] &= ~(uint64_t(1) << (position.x % 64));
+  count--;
+  blocks_hash ^= zobrist::block(position.x, position.y);
+}
+
+BlockBoard::Reach BlockBoard::explosion(
+  const Position &centre,
+  uint16_t radius
+  ) const {
+  Reach reach{};
+  if (!inside(centre))
+    return reach;
+  const uint64_t *row = &rows[centre.y * row_words];
+  const uint64_t *column = &columns[centre.x * column_words];
+  size_t x = centre.x, y = centre.y;
+  // A block at the centre stops every ray right away.
+  reach[0] = (uint16_t) (first_set(
+    row, x, std::min<size_t>(x + radius, size_x - 1)) - x);
+  reach[1] = (uint16_t) (first_set(
+    column, y, std::min<size_t>(y + radius, size_y - 1)) - y);
+  reach[2] = (uint16_t) (x - last_set(
+    row, x - std::min<size_t>(x, radius), x));
+  reach[3] = (uint16_t) (y - last_set(
+    column, y - std::min<size_t>(y, radius), y));
+  return reach;
+}
+
+Position BlockBoard::cell(
+  const Position &centre,
+  size_t ray,
+  uint16_t distance
+  ) {
+  switch (ray) {
+    case 0:
+      return Position((uint16_t) (centre.x + distance), centre.y);
+    case 1:
+      return Position(centre.x, (uint16_t) (centre.y + distance));
+    case 2:
+      return Position((uint16_t) (centre.x - distance), centre.y);
+    default:
+      return Position(centre.x, (uint16_t) (centre.y - distance));
+  }
+}
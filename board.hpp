@@ -0,0 +1,79 @@
+#ifndef BOARD_HPP
+#define BOARD_HPP
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <bit>
+
+struct Position;
+
+// Set of blocks on the board, stored as bitboards twice: once by rows
+// and once by columns. Every ray of an explosion is then a range of
+// consecutive bits of a single line, and the first block in its way
+// is found a whole 64-bit word at a time. Columns holding blocks are
+// marked in a bitboard of their own, so listing the blocks skips empty
+// columns 64 at a time.
+class BlockBoard {
+public:
+  // How far an explosion reaches from its centre along the rays right
+  // (+x), up (+y), left (-x) and down (-y), in this order. A ray ends
+  // after `radius` cells, at the edge of the board or on the first
+  // block in its way, which is included.
+  static constexpr size_t RAYS = 4;
+  using Reach = std::array<uint16_t, RAYS>;
+
+  BlockBoard(uint16_t size_x = 0, uint16_t size_y = 0);
+
+  // Changes the size of the board, removing all blocks.
+  void resize(uint16_t size_x, uint16_t size_y);
+  void clear();
+
+  size_t size() const {
+    return count;
+  }
+
+  // Zobrist hash of the blocks, kept up to date by every change.
+  uint64_t hash() const {
+    return blocks_hash;
+  }
+
+  bool contains(const Position&) const;
+  // Returns false if there already was a block at the position
+  // or if it is outside of the board.
+  bool insert(const Position&);
+  void erase(const Position&);
+
+  Reach explosion(const Position &centre, uint16_t radius) const;
+
+  // Calls `f(x, y)` for every block, ordered by x and then by y.
+  template<typename F>
+  void for_each(F &&f) const {
+    for (size_t used = 0; used < row_words; used++) {
+      for (uint64_t xs = occupied[used]; xs != 0; xs &= xs - 1) {
+        size_t x = used * 64 + (size_t) std::countr_zero(xs);
+        const uint64_t *column = &columns[x * column_words];
+        for (size_t word = 0; word < column_words; word++) {
+          for (uint64_t bits = column[word]; bits != 0; bits &= bits - 1)
+            f((uint16_t) x, (uint16_t) (word * 64 + (size_t) std::countr_zero(bits)));
+        }
+      }
+    }
+  }
+
+  // The cell `distance` cells away from `centre` along the given ray.
+  static Position cell(const Position &centre, size_t ray, uint16_t distance);
+
+private:
+  uint16_t size_x, size_y;
+  size_t row_words, column_words;
+  size_t count;
+  uint64_t blocks_hash;
+  std::vector<uint64_t> rows, columns;
+  // Bit x is set if column x holds any of its `column_blocks`.
+  std::vector<uint64_t> occupied;
+  std::vector<uint16_t> column_blocks;
+
+  bool inside(const Position&) const;
+};
+
+#endif // BOARD_HPP
@@ -1,159 +1,393 @@
-#include <string>
-#include <exception>
-#include <boost/bind/bind.hpp>
-#include <boost/asio.hpp>
-#include <endian.h>
-#include "connections.hpp"
-
-template<typename T>
-void Buffer::write(T number) {
-  uint8_t *ptr = (uint8_t *) &number; 
-  data.insert(data.end(), ptr, ptr + sizeof(T));
-}
-
-Buffer &Buffer::write8(uint8_t number) {
-  write(number);
-  return *this;
-}
-
-Buffer &Buffer::write16(uint16_t number) {
-  write(htobe16(number));
-  return *this;
-}
-
-Buffer &Buffer::write32(uint32_t number) {
-  write(htobe32(number));
-  return *this;
-}
-
-Buffer &Buffer::write_string(std::string buffer) {
-  uint8_t len = (uint8_t) buffer.size();
-  write8(len);
-  data.insert(data.end(), buffer.c_str(), buffer.c_str() + len);
-  return *this;
-}
-
-void Buffer::clear() {
-  data.clear();
-}
-
-Connection& Connection::read8(uint8_t &number) {
-  read(&number, sizeof(number));
-  return *this;
-}
-
-Connection& Connection::read16(uint16_t &number) {
-  read(&number, sizeof(number));
-  number = be16toh(number);
-  return *this;
-}
-
-Connection& Connection::read32(uint32_t &number) {
-  read(&number, sizeof(number));
-  number = be32toh(number);
-  return *this;
-}
-
-Connection& Connection::read_string(std::string &buffer) {
-  uint8_t len;
-  read8(len);
-  char ret[len + 1];
-  memset(ret, 0, len + 1);
-  read(ret, len);
-  buffer = std::string(ret);
-  return *this;
-}
-
-UDPConnection::UDPConnection(
-  boost::asio::io_context &io_context, 
-  uint16_t &local_port,
-  std::string &remote_address,
-  std::string &remote_port)
-  : socket(io_context, udp::endpoint(udp::v6(), local_port)), 
-    ptr(data), 
-    end(data) {
-  udp::resolver resolver(io_context);
-  boost::system::error_code ec;
-  auto endpoints = resolver.resolve(
-    remote_address, 
-    remote_port, 
-    ec
-  );
-  if (ec)
-    throw std::invalid_argument("Could not connect to GUI");
-  endpoint = *endpoints.begin();	
-}
-
-void UDPConnection::write(Buffer &buffer) {
-  socket.send_to(
-    boost::asio::buffer(buffer.data), 
-    endpoint
-  );
-  buffer.clear();
-}
-
-void UDPConnection::read(void* buffer, size_t size) {
-  while (ptr + size > end) {
-    // Wait for datagram big enough to satisfy request.
-    size_t len = socket.receive(boost::asio::buffer(data, MAX_UDP));
-    end = data + len;
-    ptr = data;
-  }
-  memcpy(buffer, ptr, size);
-  ptr += size;
-}
-
-bool UDPConnection::has_more() const {
-  return ptr < end;
-}
-
-void UDPConnection::close() {
-  if (closed)
-    throw std::runtime_error("Connection already closed");
-  closed = true;
-  boost::system::error_code ec;
-  socket.shutdown(udp::socket::shutdown_both, ec);
-  socket.close();
-}
-
-TCPConnection::TCPConnection(
-  boost::asio::io_context &io_context, 
-  std::string &address,
-  std::string &port)
-  : socket(io_context) {
-  tcp::resolver resolver(io_context);
-  boost::system::error_code ec;
-  auto endpoints = resolver.resolve(
-    address,
-    port,
-    ec
-  );
-  if (ec)
-    throw std::invalid_argument("Could not resolve server address");
-  boost::asio::connect(socket, endpoints, ec);
-  socket.set_option(tcp::no_delay(true));
-  if (ec)
-    throw std::invalid_argument("Could not connect to server");
-}
-
-TCPConnection::TCPConnection(tcp::socket &&socket)
-: socket(std::move(socket)) {}
-
-void TCPConnection::write(Buffer &buffer) {
-  boost::asio::write(
-    socket, 
-    boost::asio::buffer(buffer.data)
-  );
-  buffer.clear();
-}
-
-void TCPConnection::read(void* buffer, size_t size) {
-  boost::asio::read(socket, boost::asio::buffer(buffer, size));
-}
-
-void TCPConnection::close() {
-  if (closed)
-    throw std::runtime_error("Connection already closed");
-  closed = true;
-  socket.close();
+#include <string>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <bit>
+#include <cerrno>
+#include <system_error>
+#include <boost/bind/bind.hpp>
+#include <boost/asio.hpp>
+#include <endian.h>
+#include <unistd.h>
+#include "connections.hpp"
+#include "uring.hpp"
+#include "logging.hpp"
+
+namespace {
+  IoBackend io_backend = IoBackend::Asio;
+
+  // Sets up io_uring for a new connection if it is the backend. Rings
+  // and registered buffers count against RLIMIT_MEMLOCK, a connection
+  // past the limit uses asio instead.
+  template<typename Uring, typename... Args>
+  std::unique_ptr<Uring> make_uring(const Args &...args) {
+    if (io_backend != IoBackend::Uring)
+      return nullptr;
+    try {
+      return std::make_unique<Uring>(args...);
+    }
+    catch (std::system_error &e) {
+      static std::atomic<bool> reported{false};
+      if (!reported.exchange(true))
+        info("io_uring setup failed, using asio: {}", e.what());
+      return nullptr;
+    }
+  }
+
+  // Errors of sends to a local socket path nobody listens on.
+  bool peer_absent(int error) {
+    return error == ENOENT || error == ECONNREFUSED;
+  }
+} // anonymous namespace
+
+IoBackend set_io_backend(IoBackend backend) {
+  if (backend == IoBackend::Uring && !IoUring::supported())
+    backend = IoBackend::Asio;
+  io_backend = backend;
+  return backend;
+}
+
+void swap16_array(void *data, size_t count) {
+  if constexpr (std::endian::native == std::endian::big)
+    return;
+  // Sixteen numbers at a time, the compiler picks the widest
+  // registers the target has.
+  using Vector = uint16_t __attribute__((vector_size(32)));
+  constexpr size_t LANES = sizeof(Vector) / sizeof(uint16_t);
+  uint8_t *bytes = (uint8_t *) data;
+  size_t i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    Vector numbers;
+    memcpy(&numbers, bytes + 2 * i, sizeof(numbers));
+    numbers = (numbers << 8) | (numbers >> 8);
+    memcpy(bytes + 2 * i, &numbers, sizeof(numbers));
+  }
+  for (; i < count; i++) {
+    uint16_t number;
+    memcpy(&number, bytes + 2 * i, sizeof(number));
+    number = __builtin_bswap16(number);
+    memcpy(bytes + 2 * i, &number, sizeof(number));
+  }
+}
+
+template<typename T>
+void Buffer::write(T number) {
+  uint8_t *ptr = (uint8_t *) &number; 
+  data.insert(data.end(), ptr, ptr + sizeof(T));
+}
+
+Buffer &Buffer::write8(uint8_t number) {
+  write(number);
+  return *this;
+}
+
+Buffer &Buffer::write16(uint16_t number) {
+  write(htobe16(number));
+  return *this;
+}
+
+Buffer &Buffer::write32(uint32_t number) {
+  write(htobe32(number));
+  return *this;
+}
+
+Buffer &Buffer::write64(uint64_t number) {
+  write(htobe64(number));
+  return *this;
+}
+
+Buffer &Buffer::write16_array(const uint16_t *numbers, size_t count) {
+  size_t offset = data.size();
+  data.resize(offset + count * sizeof(uint16_t));
+  memcpy(data.data() + offset, numbers, count * sizeof(uint16_t));
+  swap16_array(data.data() + offset, count);
+  return *this;
+}
+
+Buffer &Buffer::write_varint(uint32_t number) {
+  while (number >= 0x80) {
+    write8((uint8_t) (number | 0x80));
+    number >>= 7;
+  }
+  write8((uint8_t) number);
+  return *this;
+}
+
+Buffer &Buffer::write_string(const std::string &buffer) {
+  uint8_t len = (uint8_t) buffer.size();
+  write8(len);
+  data.insert(data.end(), buffer.c_str(), buffer.c_str() + len);
+  return *this;
+}
+
+void Buffer::clear() {
+  data.clear();
+}
+
+void Connection::set_budget(size_t bytes) {
+  budget = bytes;
+}
+
+size_t Connection::budget_left() const {
+  return budget;
+}
+
+void Connection::take(void *buffer, size_t size) {
+  if (size > budget)
+    throw std::runtime_error("Message exceeds its size limit");
+  budget -= size;
+  read(buffer, size);
+}
+
+Connection& Connection::read8(uint8_t &number) {
+  take(&number, sizeof(number));
+  return *this;
+}
+
+Connection& Connection::read16(uint16_t &number) {
+  take(&number, sizeof(number));
+  number = be16toh(number);
+  return *this;
+}
+
+Connection& Connection::read32(uint32_t &number) {
+  take(&number, sizeof(number));
+  number = be32toh(number);
+  return *this;
+}
+
+Connection& Connection::read64(uint64_t &number) {
+  take(&number, sizeof(number));
+  number = be64toh(number);
+  return *this;
+}
+
+Connection& Connection::read16_array(uint16_t *numbers, size_t count) {
+  take(numbers, count * sizeof(uint16_t));
+  swap16_array(numbers, count);
+  return *this;
+}
+
+Connection& Connection::read_varint(uint32_t &number) {
+  number = 0;
+  for (uint32_t shift = 0;; shift += 7) {
+    uint8_t byte;
+    read8(byte);
+    // A 32-bit number never needs more than 5 bytes.
+    if (shift == 28 && byte > 0x0f)
+      throw std::runtime_error("Varint too long");
+    number |= (uint32_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return *this;
+}
+
+Connection& Connection::read_string(std::string &buffer) {
+  uint8_t len;
+  read8(len);
+  buffer.resize(len);
+  take(buffer.data(), len);
+  return *this;
+}
+
+Connection& Connection::read_bytes(void *buffer, size_t size) {
+  take(buffer, size);
+  return *this;
+}
+
+void DatagramConnection::read(void* buffer, size_t size) {
+  while (ptr + size > end) {
+    // Wait for datagram big enough to satisfy request.
+    size_t len = receive(data, MAX_DATAGRAM);
+    end = data + len;
+    ptr = data;
+  }
+  memcpy(buffer, ptr, size);
+  ptr += size;
+}
+
+bool DatagramConnection::has_more() const {
+  return ptr < end;
+}
+
+UDPConnection::UDPConnection(
+  boost::asio::io_context &io_context, 
+  uint16_t &local_port,
+  std::string &remote_address,
+  std::string &remote_port)
+  : socket(io_context, udp::endpoint(udp::v6(), local_port)) {
+  udp::resolver resolver(io_context);
+  boost::system::error_code ec;
+  auto endpoints = resolver.resolve(
+    remote_address, 
+    remote_port, 
+    ec
+  );
+  if (ec)
+    throw std::invalid_argument("Could not connect to GUI");
+  endpoint = *endpoints.begin();	
+  uring = make_uring<UringDatagram>(
+    socket.native_handle(),
+    endpoint.data(),
+    (socklen_t) endpoint.size()
+  );
+}
+
+UDPConnection::~UDPConnection() = default;
+
+void UDPConnection::write(Buffer &buffer) {
+  if (uring)
+    uring->send(buffer.data.data(), buffer.data.size());
+  else
+    socket.send_to(
+      boost::asio::buffer(buffer.data), 
+      endpoint
+    );
+  buffer.clear();
+}
+
+size_t UDPConnection::receive(void *buffer, size_t size) {
+  if (uring)
+    return uring->receive(buffer, size);
+  return socket.receive(boost::asio::buffer(buffer, size));
+}
+
+void UDPConnection::close() {
+  if (closed)
+    throw std::runtime_error("Connection already closed");
+  closed = true;
+  if (uring)
+    uring->cancel();
+  boost::system::error_code ec;
+  socket.shutdown(udp::socket::shutdown_both, ec);
+  socket.close();
+}
+
+UnixConnection::UnixConnection(
+  boost::asio::io_context &io_context,
+  const std::string &local_path,
+  const std::string &remote_path)
+  : socket(io_context),
+    endpoint(remote_path),
+    local_path(local_path) {
+  // Remove a socket file left behind by a previous run.
+  ::unlink(local_path.c_str());
+  boost::system::error_code ec;
+  socket.open(local(), ec);
+  if (!ec)
+    socket.bind(local::endpoint(local_path), ec);
+  if (ec)
+    throw std::invalid_argument("Could not bind the local socket");
+  uring = make_uring<UringDatagram>(
+    socket.native_handle(),
+    endpoint.data(),
+    (socklen_t) endpoint.size()
+  );
+}
+
+UnixConnection::~UnixConnection() {
+  ::unlink(local_path.c_str());
+}
+
+void UnixConnection::write(Buffer &buffer) {
+  // Like UDP datagrams to an absent GUI, states for a GUI that has not
+  // bound its socket yet, or is gone, are dropped.
+  if (uring) {
+    try {
+      uring->send(buffer.data.data(), buffer.data.size());
+    }
+    catch (std::system_error &e) {
+      if (!peer_absent(e.code().value()))
+        throw;
+    }
+  }
+  else {
+    boost::system::error_code ec;
+    socket.send_to(boost::asio::buffer(buffer.data), endpoint, 0, ec);
+    if (ec && !peer_absent(ec.value()))
+      throw boost::system::system_error(ec);
+  }
+  buffer.clear();
+}
+
+size_t UnixConnection::receive(void *buffer, size_t size) {
+  if (uring)
+    return uring->receive(buffer, size);
+  return socket.receive(boost::asio::buffer(buffer, size));
+}
+
+void UnixConnection::close() {
+  if (closed)
+    throw std::runtime_error("Connection already closed");
+  closed = true;
+  if (uring)
+    uring->cancel();
+  boost::system::error_code ec;
+  socket.shutdown(local::socket::shutdown_both, ec);
+  socket.close();
+}
+
+TCPConnection::TCPConnection(
+  boost::asio::io_context &io_context, 
+  std::string &address,
+  std::string &port)
+  : socket(io_context) {
+  tcp::resolver resolver(io_context);
+  boost::system::error_code ec;
+  auto endpoints = resolver.resolve(
+    address,
+    port,
+    ec
+  );
+  if (ec)
+    throw std::invalid_argument("Could not resolve server address");
+  boost::asio::connect(socket, endpoints, ec);
+  socket.set_option(tcp::no_delay(true));
+  if (ec)
+    throw std::invalid_argument("Could not connect to server");
+  uring = make_uring<UringStream>(socket.native_handle());
+}
+
+TCPConnection::TCPConnection(tcp::socket &&socket)
+: socket(std::move(socket)) {
+  uring = make_uring<UringStream>(this->socket.native_handle());
+}
+
+TCPConnection::~TCPConnection() = default;
+
+void TCPConnection::write(Buffer &buffer) {
+  if (uring)
+    uring->write(buffer.data);
+  else
+    boost::asio::write(
+      socket, 
+      boost::asio::buffer(buffer.data)
+    );
+  buffer.clear();
+}
+
+void TCPConnection::read(void* buffer, size_t size) {
+  if (uring)
+    uring->read(buffer, size);
+  else
+    boost::asio::read(socket, boost::asio::buffer(buffer, size));
+}
+
+void TCPConnection::shutdown() {
+  boost::system::error_code ec;
+  socket.shutdown(tcp::socket::shutdown_both, ec);
+}
+
+void TCPConnection::close() {
+  if (closed)
+    throw std::runtime_error("Connection already closed");
+  closed = true;
+  // Requests in flight hold on to the socket, shutting it down
+  // ends them.
+  if (uring) {
+    boost::system::error_code ec;
+    socket.shutdown(tcp::socket::shutdown_both, ec);
+  }
+  socket.close();
 }
\ No newline at end of file
@@ -1,102 +1,201 @@
-#ifndef CONNECTIONS_HPP
-#define CONNECTIONS_HPP
-#include <iostream>
-#include <string>
-#include <exception>
-#include <boost/bind/bind.hpp>
-#include <boost/asio.hpp>
-#include <endian.h>
-
-// Helper class for serializing outgoing messages.
-// The writeX functions convert binary numbers to network order.
-class Buffer {
-public: 
-  std::vector<uint8_t> data{};
-
-  Buffer() = default;
-
-  Buffer &write8(uint8_t);
-
-  Buffer &write16(uint16_t);
-
-  Buffer &write32(uint32_t);
-
-  Buffer &write_string(std::string);
-
-  void clear();
-
-private:
-  template<typename T>
-  void write(T);
-};
-
-// Abstract base class for connections.
-// Connection classes provide the ability to read from
-// and write to sockets.
-class Connection {
-public:
-  virtual void write(Buffer &buffer) = 0;
-
-  Connection& read8(uint8_t&);
-
-  Connection& read16(uint16_t&);
-
-  Connection& read32(uint32_t&);
-
-  Connection& read_string(std::string&);
-
-  virtual void close() = 0;
-
-protected:
-  bool closed{false};
-
-  virtual void read(void*, size_t) = 0;	
-};
-
-// Class wrapping the boost UDP socket.
-class UDPConnection : public Connection {
-public:
-  UDPConnection(
-    boost::asio::io_context&, 
-    uint16_t&, 
-    std::string&, 
-    std::string&
-  );
-
-  void write(Buffer&) override;
-
-  bool has_more() const;
-
-  void close() override;
-
-private:
-  using udp = boost::asio::ip::udp;
-  udp::socket socket;
-  udp::endpoint endpoint;
-
-  static constexpr size_t MAX_UDP = 65535;
-  char data[MAX_UDP];
-  char *ptr, *end;
-
-  void read(void*, size_t) override;
-};
-
-// Class wrapping the boost TCP socket
-class TCPConnection : public Connection {
-public:
-  TCPConnection(boost::asio::io_context&, std::string&, std::string&);
-
-  TCPConnection(boost::asio::ip::tcp::socket&&);
-
-  void write(Buffer&) override;
-
-  void close() override;
-
-private:
-  using tcp = boost::asio::ip::tcp;
-  tcp::socket socket;
-
-  void read(void*, size_t) override;
-};
-
-#endif // CONNECTIONS_HPP
+#ifndef CONNECTIONS_HPP
+#define CONNECTIONS_HPP
+#include <iostream>
+#include <string>
+#include <memory>
+#include <exception>
+#include <boost/bind/bind.hpp>
+#include <boost/asio.hpp>
+#include <endian.h>
+
+class UringStream;
+class UringDatagram;
+
+// Implementation of the socket operations. With io_uring, connections
+// read through rings of their own and streams write through one ring
+// of the process (Linux only). Connections that cannot set up their
+// rings use asio.
+enum struct IoBackend : uint8_t {
+  Asio = 0, Uring = 1
+};
+
+// Sets the backend of connections created from now on. Falls back to
+// Asio if io_uring is not available, returns the backend set.
+IoBackend set_io_backend(IoBackend);
+
+// Converts `count` 16-bit numbers stored at any address between host
+// and network order, many at a time with vector instructions.
+void swap16_array(void*, size_t count);
+
+// Helper class for serializing outgoing messages.
+// The writeX functions convert binary numbers to network order.
+class Buffer {
+public: 
+  std::vector<uint8_t> data{};
+
+  Buffer() = default;
+
+  Buffer &write8(uint8_t);
+
+  Buffer &write16(uint16_t);
+
+  Buffer &write32(uint32_t);
+
+  Buffer &write64(uint64_t);
+
+  Buffer &write16_array(const uint16_t*, size_t count);
+
+  // Writes an unsigned LEB128 varint (7 bits per byte, low bits first).
+  Buffer &write_varint(uint32_t);
+
+  Buffer &write_string(const std::string&);
+
+  void clear();
+
+private:
+  template<typename T>
+  void write(T);
+};
+
+// Abstract base class for connections.
+// Connection classes provide the ability to read from
+// and write to sockets.
+class Connection {
+public:
+  virtual void write(Buffer &buffer) = 0;
+
+  Connection& read8(uint8_t&);
+
+  Connection& read16(uint16_t&);
+
+  Connection& read32(uint32_t&);
+
+  Connection& read64(uint64_t&);
+
+  Connection& read16_array(uint16_t*, size_t count);
+
+  Connection& read_varint(uint32_t&);
+
+  Connection& read_string(std::string&);
+
+  // Reads raw bytes, left in network order.
+  Connection& read_bytes(void*, size_t);
+
+  // Bounds the bytes the following reads may take together, a read
+  // past the budget throws before anything is received. Parsers set
+  // one for every message.
+  void set_budget(size_t);
+
+  size_t budget_left() const;
+
+  virtual void close() = 0;
+
+protected:
+  bool closed{false};
+
+  virtual void read(void*, size_t) = 0;	
+
+private:
+  size_t budget{SIZE_MAX};
+
+  void take(void*, size_t);
+};
+
+// Base class for datagram connections. Reads are served from the last
+// received datagram, every message is sent in a datagram of its own.
+class DatagramConnection : public Connection {
+public:
+  // Checks if the last datagram has unread bytes left.
+  bool has_more() const;
+
+protected:
+  static constexpr size_t MAX_DATAGRAM = 65535;
+
+  // Waits for the next datagram and returns its length.
+  virtual size_t receive(void*, size_t) = 0;
+
+private:
+  char data[MAX_DATAGRAM];
+  char *ptr{data}, *end{data};
+
+  void read(void*, size_t) override;
+};
+
+// Class wrapping the boost UDP socket.
+class UDPConnection : public DatagramConnection {
+public:
+  UDPConnection(
+    boost::asio::io_context&, 
+    uint16_t&, 
+    std::string&, 
+    std::string&
+  );
+
+  ~UDPConnection();
+
+  void write(Buffer&) override;
+
+  void close() override;
+
+private:
+  using udp = boost::asio::ip::udp;
+  udp::socket socket;
+  udp::endpoint endpoint;
+  std::unique_ptr<UringDatagram> uring;
+
+  size_t receive(void*, size_t) override;
+};
+
+// Class wrapping a local datagram socket, for peers on the same host.
+// It listens on `local_path` and sends to `remote_path`, skipping the
+// IP stack of the loopback interface.
+class UnixConnection : public DatagramConnection {
+public:
+  UnixConnection(
+    boost::asio::io_context&,
+    const std::string &local_path,
+    const std::string &remote_path
+  );
+
+  ~UnixConnection();
+
+  void write(Buffer&) override;
+
+  void close() override;
+
+private:
+  using local = boost::asio::local::datagram_protocol;
+  local::socket socket;
+  local::endpoint endpoint;
+  std::string local_path;
+  std::unique_ptr<UringDatagram> uring;
+
+  size_t receive(void*, size_t) override;
+};
+
+// Class wrapping the boost TCP socket
+class TCPConnection : public Connection {
+public:
+  TCPConnection(boost::asio::io_context&, std::string&, std::string&);
+
+  TCPConnection(boost::asio::ip::tcp::socket&&);
+
+  ~TCPConnection();
+
+  void write(Buffer&) override;
+
+  void close() override;
+
+  // Ends the connection both ways, so threads blocked on it wake up.
+  // Unlike close, it may be called while other threads use it.
+  void shutdown();
+
+private:
+  using tcp = boost::asio::ip::tcp;
+  tcp::socket socket;
+  std::unique_ptr<UringStream> uring;
+
+  void read(void*, size_t) override;
+};
+
+#endif // CONNECTIONS_HPP
@@ -0,0 +1,292 @@
+#include <array>
+#include <tuple>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include "game.hpp"
+#include "zobrist.hpp"
+
+namespace {
+  // Turns with fewer explosions are not worth spreading across threads.
+  constexpr size_t PARALLEL_EXPLOSIONS = 32;
+} // anonymous namespace
+
+PackedInput pack_input(const ClientToServer &in) {
+  uint16_t direction = 0;
+  if (in.type == ClientToServerType::Move)
+    direction = static_cast<uint16_t>(in.direction);
+  return (PackedInput) (
+    1 << 8 | static_cast<uint16_t>(in.type) << 2 | direction
+  );
+}
+
+bool unpack_input(PackedInput packed, ClientToServer &out) {
+  if (packed == 0)
+    return false;
+  out.type = ClientToServerType((packed >> 2) & 3);
+  out.direction = Direction(packed & 3);
+  return true;
+}
+
+Game::Game(const ServerOptions &options)
+: blocks(options.size_x, options.size_y),
+  options(options),
+  random(options.seed),
+  explosion_workers(options.explosion_threads) {}
+
+void Game::move_robot(Player::PlayerId id, const Position &position) {
+  auto [it, inserted] = player_positions.try_emplace(id, position);
+  if (!inserted) {
+    pieces_hash ^= zobrist::robot(id, it->second.x, it->second.y);
+    it->second = position;
+  }
+  pieces_hash ^= zobrist::robot(id, position.x, position.y);
+}
+
+void Game::add_score(Player::PlayerId id, Player::Score points) {
+  Player::Score &score = scores[id];
+  pieces_hash ^= zobrist::score(id, score);
+  score += points;
+  pieces_hash ^= zobrist::score(id, score);
+}
+
+void Game::toggle_bomb(Bomb::BombId id, const Position &position) {
+  pieces_hash ^= zobrist::bomb(id, position.x, position.y);
+}
+
+Position Game::random_position() {
+  uint16_t x = uint16_t(random() % options.size_x),
+           y = uint16_t(random() % options.size_y);
+  return Position(x, y);
+}
+
+void Game::start(std::vector<Event> &events) {
+  player_positions.clear();
+  blocks.clear();
+  bombs.clear();
+  current_bomb = 0;
+  pieces_hash = 0;
+
+  for (uint8_t id = 0; id < options.players_count; id++) {
+    Event event{};
+    event.type = EventType::PlayerMoved;
+    event.player_id = id;
+    event.position = random_position();
+    move_robot(id, event.position);
+    events.push_back(event);
+  }
+  for (uint16_t i = 0; i < options.initial_blocks; i++) {
+    Event event{};
+    event.type = EventType::BlockPlaced;
+    event.position = random_position();
+    // Check if there was already a block at this position.
+    if (blocks.insert(event.position))
+      events.push_back(event);
+  }
+}
+
+uint64_t Game::allocations(const std::vector<Event> &events) {
+  uint64_t count = 0;
+  for (const Event &event : events) {
+    if (event.type == EventType::BombPlaced)
+      count++;
+    else if (event.type == EventType::BombExploded)
+      count += !event.robots_destroyed.empty() +
+        !event.blocks_destroyed.empty();
+  }
+  return count;
+}
+
+void Game::discard_inputs() {
+  for (uint16_t id = 0; id < options.players_count; id++)
+    inputs[id].action.store(0, std::memory_order_relaxed);
+}
+
+// Helper function for processing bomb explosions.
+// Computes the explosion of one bomb on the board from before the
+// turn. Explosions do not depend on each other, so they can be
+// computed at the same time.
+void Game::explode(
+  Bomb::BombId bomb_id,
+  const Position &centre,
+  Event &event
+  ) const {
+  event.type = EventType::BombExploded;
+  event.bomb_id = bomb_id;
+  event.robots_destroyed.clear();
+  event.blocks_destroyed.clear();
+
+  BlockBoard::Reach reach = blocks.explosion(centre, options.explosion_radius);
+  // If the explosion reaches a block, it stops there.
+  // The centre is reported only once. The lists are filled in one go,
+  // so that each takes a single allocation.
+  std::array<Position, BlockBoard::RAYS> ends;
+  size_t destroyed = 0;
+  for (size_t ray = 0; ray < BlockBoard::RAYS; ray++) {
+    Position end = BlockBoard::cell(centre, ray, reach[ray]);
+    if ((reach[ray] > 0 || ray == 0) && blocks.contains(end))
+      ends[destroyed++] = end;
+  }
+  event.blocks_destroyed.assign(ends.begin(), ends.begin() + destroyed);
+  // Check if any robots were destroyed, ordered by ray
+  // and distance from the bomb. Explosions are computed on several
+  // threads, so each one has its own arena, on the stack.
+  using Hit = std::tuple<size_t, uint16_t, Player::PlayerId>;
+  std::array<std::byte, 256 * sizeof(Hit)> memory;
+  std::pmr::monotonic_buffer_resource arena(memory.data(), memory.size());
+  std::pmr::vector<Hit> hits(&arena);
+  hits.reserve(player_positions.size());
+  for (const auto &[id, p] : player_positions) {
+    if (p == centre)
+      hits.emplace_back(0, 0, id);
+    else if (p.y == centre.y && p.x > centre.x &&
+             p.x - centre.x <= reach[0])
+      hits.emplace_back(0, (uint16_t) (p.x - centre.x), id);
+    else if (p.x == centre.x && p.y > centre.y &&
+             p.y - centre.y <= reach[1])
+      hits.emplace_back(1, (uint16_t) (p.y - centre.y), id);
+    else if (p.y == centre.y && p.x < centre.x &&
+             centre.x - p.x <= reach[2])
+      hits.emplace_back(2, (uint16_t) (centre.x - p.x), id);
+    else if (p.x == centre.x && p.y < centre.y &&
+             centre.y - p.y <= reach[3])
+      hits.emplace_back(3, (uint16_t) (centre.y - p.y), id);
+  }
+  std::sort(hits.begin(), hits.end());
+  if (!hits.empty())
+    event.robots_destroyed.reserve(hits.size());
+  for (const auto &[ray, distance, id] : hits)
+    event.robots_destroyed.push_back(id);
+}
+
+void Game::process_bombs(
+  std::vector<Event> &current_events,
+  std::pmr::set<Player::PlayerId> &robots_destroyed,
+  std::pmr::memory_resource &arena
+  ) {
+  // Bombs exploding in this turn, in the order of their ids.
+  std::pmr::vector<std::pair<Bomb::BombId, Position>> exploding(&arena);
+  for (auto &[bomb_id, bomb] : bombs) {
+    bomb.timer--;
+    if (bomb.timer == 0)
+      exploding.emplace_back(bomb_id, bomb.position);
+  }
+  if (exploding.empty())
+    return;
+
+  std::pmr::vector<Event> events(exploding.size(), &arena);
+  auto explode_one = [&](size_t i) {
+    explode(exploding[i].first, exploding[i].second, events[i]);
+  };
+  if (exploding.size() >= PARALLEL_EXPLOSIONS)
+    explosion_workers.run(exploding.size(), std::ref(explode_one));
+  else {
+    for (size_t i = 0; i < exploding.size(); i++)
+      explode_one(i);
+  }
+
+  // The board changes only after all explosions are known.
+  for (Event &event : events) {
+    for (const Player::PlayerId &id : event.robots_destroyed)
+      robots_destroyed.insert(id);
+    for (const Position &position : event.blocks_destroyed)
+      blocks.erase(position);
+    auto bomb = bombs.find(event.bomb_id);
+    toggle_bomb(bomb->first, bomb->second.position);
+    bombs.erase(bomb);
+    current_events.push_back(std::move(event));
+  }
+}
+
+void Game::process_turn(
+  std::vector<Event> &current_events,
+  std::pmr::memory_resource &arena
+  ) {
+  std::pmr::set<Player::PlayerId> robots_destroyed(&arena);
+
+  // Take a snapshot of this turn's actions, consuming them.
+  std::array<PackedInput, 256> actions;
+  for (uint16_t id = 0; id < options.players_count; id++) {
+    actions[id] = inputs[id].action.exchange(
+      0,
+      std::memory_order_relaxed
+    );
+  }
+
+  process_bombs(current_events, robots_destroyed, arena);
+
+  Event event;
+  for (uint8_t id = 0; id < options.players_count; id++) {
+    // Ignore destroyed robots' moves.
+    if (robots_destroyed.contains(id)) {
+      event.type = EventType::PlayerMoved;
+      event.player_id = id;
+      event.position = random_position();
+      move_robot(id, event.position);
+      current_events.push_back(event);
+      add_score(id, 1);
+    }
+    else {
+      ClientToServer move;
+      if (!unpack_input(actions[id], move))
+        continue;
+
+      switch (move.type) {
+        case ClientToServerType::PlaceBomb:
+          event.type = EventType::BombPlaced;
+          event.bomb_id = current_bomb;
+          event.position = player_positions[id];
+          bombs[current_bomb] = Bomb(
+            event.position,
+            options.bomb_timer
+          );
+          toggle_bomb(current_bomb, event.position);
+          current_bomb++;
+          current_events.push_back(event);
+          break;
+        case ClientToServerType::PlaceBlock:
+          if (!blocks.contains(player_positions[id])) {
+            event.type = EventType::BlockPlaced;
+            event.position = player_positions[id];
+            blocks.insert(player_positions[id]);
+            current_events.push_back(event);
+          }
+          break;
+        case ClientToServerType::Move:
+          {
+          event.type = EventType::PlayerMoved;
+          event.player_id = id;
+          event.position = player_positions[id];
+          uint16_t x = event.position.x, y = event.position.y;
+          switch (move.direction) {
+            case Direction::Up:
+              if (y + 1 < options.size_y)
+                event.position = Position(x, (uint16_t) (y + 1));
+              break;
+            case Direction::Right:
+              if (x + 1 < options.size_x)
+                event.position = Position((uint16_t) (x + 1), y);
+              break;
+            case Direction::Down:
+              if (y - 1 >= 0)
+                event.position = Position(x, (uint16_t) (y - 1));
+              break;
+            case Direction::Left:
+              if (x - 1 >= 0)
+                event.position = Position((uint16_t) (x - 1), y);
+              break;
+          }
+          if (blocks.contains(event.position))
+            break;
+          if (event.position.x != x || event.position.y != y) {
+            move_robot(id, event.position);
+            current_events.push_back(event);
+          }
+          break;
+          }
+        default:
+          throw std::runtime_error("Something went wrong");
+      }
+    }
+  }
+}
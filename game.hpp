@@ -0,0 +1,103 @@
+#ifndef GAME_HPP
+#define GAME_HPP
+#include <array>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+#include <random>
+#include <memory_resource>
+#include "messages.hpp"
+#include "program_options.hpp"
+#include "board.hpp"
+#include "workers.hpp"
+
+// A player's action packed into 16 bits, so that it can be published
+// atomically. Bit 8 marks a present action, bits 2-3 hold its type
+// and bits 0-1 the direction of a move.
+using PackedInput = uint16_t;
+
+PackedInput pack_input(const ClientToServer&);
+bool unpack_input(PackedInput, ClientToServer&);
+
+// Holds the last action of one player in the current turn. Each slot
+// has its own cache line, so receivers of different players never
+// share one.
+struct alignas(64) InputSlot {
+  std::atomic<PackedInput> action{0};
+};
+
+// The board of the running game and the rules turning the players'
+// actions into the events of a turn. Receiver threads publish actions
+// to the input slots without locking, everything else is changed only
+// by the game handler.
+class Game {
+public:
+  // Memory for the temporaries of one turn, enough for every robot
+  // placing bombs all the time. Bigger turns take the rest from the heap.
+  static constexpr size_t TURN_ARENA = 64 * 1024;
+
+  std::map<Player::PlayerId, Player::Score> scores;
+  std::map<Player::PlayerId, Position> player_positions;
+  BlockBoard blocks;
+  std::map<Bomb::BombId, Bomb> bombs;
+  Bomb::BombId current_bomb{0};
+  std::array<InputSlot, 256> inputs{};
+
+  // `options` must outlive the game.
+  explicit Game(const ServerOptions &options);
+
+  // Clears the board and places the robots and the initial blocks of a
+  // new game, reported as the events of its first turn.
+  void start(std::vector<Event> &events);
+
+  // Takes the players' actions and processes one turn. Its temporaries
+  // are allocated from `arena`, released after the turn.
+  void process_turn(std::vector<Event> &events, std::pmr::memory_resource &arena);
+
+  // Discards actions that arrived while a turn was processed.
+  void discard_inputs();
+
+  // Most events of a turn after the first: an action or a respawn of
+  // every robot and an explosion of at most one bomb of each, as bombs
+  // placed in the same turn explode together.
+  size_t max_turn_events() const {
+    return 2 * (size_t) options.players_count;
+  }
+
+  // Heap allocations of a turn with these events, given room for the
+  // events: the node of the bomb map of every placed bomb and the lists
+  // of destroyed robots and blocks that explosions own. Everything else
+  // comes from the turn's arena.
+  static uint64_t allocations(const std::vector<Event>&);
+
+  // Zobrist hash of the board, the same as the clients' for the same
+  // board.
+  uint64_t hash() const {
+    return blocks.hash() ^ pieces_hash;
+  }
+
+private:
+  const ServerOptions &options;
+  std::minstd_rand random;
+  // Threads computing explosions of turns with many bombs.
+  WorkerPool explosion_workers;
+  // Zobrist hash of robots, bombs and scores, blocks hash themselves.
+  uint64_t pieces_hash{0};
+
+  // Game state changes that keep `pieces_hash` up to date.
+  void move_robot(Player::PlayerId, const Position&);
+  void add_score(Player::PlayerId, Player::Score);
+  // Adds a bomb to the hash or removes it.
+  void toggle_bomb(Bomb::BombId, const Position&);
+
+  Position random_position();
+  void explode(Bomb::BombId, const Position &centre, Event&) const;
+  void process_bombs(
+    std::vector<Event>&,
+    std::pmr::set<Player::PlayerId> &robots_destroyed,
+    std::pmr::memory_resource&
+  );
+};
+
+#endif // GAME_HPP
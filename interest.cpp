@@ -0,0 +1,344 @@
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include <new>
+#include "interest.hpp"
+
+bool Area::contains(const Position &position) const {
+  return x0 <= position.x && position.x <= x1 &&
+         y0 <= position.y && position.y <= y1;
+}
+
+InterestIndex::InterestIndex(const ServerOptions &options)
+  : radius(options.interest_radius),
+    size_x(options.size_x),
+    size_y(options.size_y),
+    bomb_timer(options.bomb_timer),
+    players(options.players_count),
+    levels((uint16_t) std::bit_width(
+      (unsigned) std::max(options.size_x, options.size_y) - 1
+    )),
+    // A window spans at most two tiles in each axis.
+    tile_shift((uint16_t) std::bit_width(2u * options.interest_radius)),
+    roots(std::make_unique<Node*[]>(options.game_length + 1)),
+    tiles(std::make_unique<std::vector<std::pair<uint32_t, uint32_t>>[]>(
+      options.game_length + 1
+    )),
+    positions(std::make_unique<std::vector<Position>[]>(
+      options.game_length + 1
+    )) {}
+
+Area InterestIndex::area_around(const Position &position) const {
+  return Area{
+    (uint16_t) std::max(position.x - radius, 0),
+    (uint16_t) std::max(position.y - radius, 0),
+    (uint16_t) std::min(position.x + radius, size_x - 1),
+    (uint16_t) std::min(position.y + radius, size_y - 1)
+  };
+}
+
+uint32_t InterestIndex::tile(const Position &position) const {
+  return (uint32_t) (position.x >> tile_shift) << 16 |
+    (uint32_t) (position.y >> tile_shift);
+}
+
+void InterestIndex::events_in(
+  uint16_t turn,
+  const Area &area,
+  std::vector<uint32_t> &out
+  ) const {
+  const auto &entries = tiles[turn];
+  // Tiles of one column are next to each other in the index.
+  uint32_t x0 = area.x0 >> tile_shift, x1 = area.x1 >> tile_shift,
+           y0 = area.y0 >> tile_shift, y1 = area.y1 >> tile_shift;
+  for (uint32_t x = x0; x <= x1; x++) {
+    uint32_t first = x << 16 | y0, last = x << 16 | y1;
+    auto it = std::lower_bound(
+      entries.begin(), entries.end(), std::make_pair(first, uint32_t(0))
+    );
+    for (; it != entries.end() && it->first <= last; it++)
+      out.push_back(it->second);
+  }
+}
+
+void InterestIndex::events_at(
+  uint16_t turn,
+  uint32_t key,
+  std::vector<uint32_t> &out
+  ) const {
+  const auto &entries = tiles[turn];
+  auto it = std::lower_bound(
+    entries.begin(), entries.end(), std::make_pair(key, uint32_t(0))
+  );
+  for (; it != entries.end() && it->first == key; it++)
+    out.push_back(it->second);
+}
+
+InterestIndex::Node *InterestIndex::make_node(const Node *copy) {
+  Node *node = new (memory.allocate(sizeof(Node), alignof(Node)))
+    Node(copy ? *copy : Node{});
+  node->turn = building;
+  return node;
+}
+
+const InterestIndex::BombEntry *InterestIndex::make_bomb(
+  Bomb::BombId id,
+  uint32_t explodes,
+  const BombEntry *next
+  ) {
+  return new (memory.allocate(sizeof(BombEntry), alignof(BombEntry)))
+    BombEntry{id, explodes, next};
+}
+
+template <typename F>
+void InterestIndex::change(const Position &at, F f) {
+  // Slots on the path from the root to the cell.
+  std::array<Node**, 32> path;
+  Node **slot = &root;
+  for (uint16_t level = levels;; level--) {
+    if (*slot == nullptr || (*slot)->turn != building)
+      *slot = make_node(*slot);
+    path[level] = slot;
+    if (level == 0)
+      break;
+    uint32_t quarter = (uint32_t) ((at.x >> (level - 1)) & 1) |
+      (uint32_t) ((at.y >> (level - 1)) & 1) << 1;
+    slot = &(*slot)->children[quarter];
+  }
+  Node &cell = **slot;
+  f(cell);
+  if (cell.block || cell.bombs != nullptr)
+    return;
+  // Queries skip what holds nothing.
+  for (uint16_t level = 0; level <= levels; level++) {
+    Node *&node = *path[level];
+    if (level > 0 && std::any_of(
+          node->children.begin(), node->children.end(),
+          [](const Node *child) { return child != nullptr; }
+        ))
+      return;
+    node = nullptr;
+  }
+}
+
+void InterestIndex::index(
+  std::vector<std::pair<uint32_t, uint32_t>> &entries,
+  const Position &position,
+  uint32_t event
+  ) {
+  entries.emplace_back(tile(position), event);
+}
+
+void InterestIndex::add_turn(uint16_t turn, const std::vector<Event> &events) {
+  building = turn;
+  std::vector<Position> &now = positions[turn];
+  if (turn > 0)
+    now = positions[turn - 1];
+  else
+    now.resize(players);
+  auto &entries = tiles[turn];
+  for (uint32_t i = 0; i < events.size(); i++) {
+    const Event &event = events[i];
+    switch (event.type) {
+      case EventType::BombPlaced:
+        index(entries, event.position, i);
+        live_bombs.emplace(event.bomb_id, event.position);
+        change(event.position, [&](Node &cell) {
+          cell.bombs =
+            make_bomb(event.bomb_id, (uint32_t) turn + bomb_timer, cell.bombs);
+        });
+        break;
+      case EventType::BombExploded:
+        {
+        // Filters knowing the bomb or a destroyed block look here.
+        auto bomb = live_bombs.find(event.bomb_id);
+        index(entries, bomb->second, i);
+        change(bomb->second, [&](Node &cell) {
+          // Entries are shared with older turns, copy the ones before.
+          const BombEntry *rest = nullptr;
+          std::vector<const BombEntry*> before;
+          for (const BombEntry *it = cell.bombs; it; it = it->next) {
+            if (it->id == event.bomb_id) {
+              rest = it->next;
+              break;
+            }
+            before.push_back(it);
+          }
+          for (auto it = before.rbegin(); it != before.rend(); it++)
+            rest = make_bomb((*it)->id, (*it)->explodes, rest);
+          cell.bombs = rest;
+        });
+        live_bombs.erase(bomb);
+        for (const Position &position : event.blocks_destroyed) {
+          index(entries, position, i);
+          change(position, [](Node &cell) { cell.block = false; });
+        }
+        if (!event.robots_destroyed.empty())
+          entries.emplace_back(EVERYWHERE, i);
+        break;
+        }
+      case EventType::PlayerMoved:
+        // Filters seeing the robot leave look where it was.
+        if (turn > 0 && tile(now[event.player_id]) != tile(event.position))
+          index(entries, now[event.player_id], i);
+        index(entries, event.position, i);
+        now[event.player_id] = event.position;
+        break;
+      case EventType::BlockPlaced:
+        index(entries, event.position, i);
+        change(event.position, [](Node &cell) { cell.block = true; });
+        break;
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  roots[turn] = root;
+}
+
+void InterestFilter::reset(
+  Player::PlayerId viewer,
+  const InterestIndex &index
+  ) {
+  this->index = &index;
+  this->viewer = viewer;
+  window.reset();
+  known_blocks.clear();
+  known_bombs.clear();
+  known_players.fill(std::nullopt);
+  known_tiles.clear();
+}
+
+void InterestFilter::know(const Position &position) {
+  known_tiles[index->tile(position)]++;
+}
+
+void InterestFilter::forget(const Position &position) {
+  auto it = known_tiles.find(index->tile(position));
+  if (--it->second == 0)
+    known_tiles.erase(it);
+}
+
+void InterestFilter::filter(
+  uint16_t turn,
+  const std::vector<Event> &events,
+  std::vector<Event> &out
+  ) {
+  out.clear();
+  // The window is placed around the viewer's position at the end
+  // of the turn.
+  Area current = index->area_around(index->position(turn, viewer));
+
+  // Events in the window, of what the client knows outside of it and
+  // the ones everybody gets, each once and in the turn's order.
+  selected.clear();
+  index->events_in(turn, current, selected);
+  index->events_at(turn, InterestIndex::EVERYWHERE, selected);
+  for (const auto &[tile, count] : known_tiles)
+    index->events_at(turn, tile, selected);
+  std::sort(selected.begin(), selected.end());
+  selected.erase(std::unique(selected.begin(), selected.end()), selected.end());
+
+  // Like the client, forget destroyed blocks only after the whole turn.
+  forgotten_blocks.clear();
+  for (uint32_t i : selected) {
+    const Event &event = events[i];
+    switch (event.type) {
+      case EventType::BombPlaced:
+        if (current.contains(event.position)) {
+          if (known_bombs.emplace(event.bomb_id, event.position).second)
+            know(event.position);
+          out.push_back(event);
+        }
+        break;
+      case EventType::BombExploded:
+        {
+        auto bomb = known_bombs.find(event.bomb_id);
+        bool known = bomb != known_bombs.end();
+        if (known) {
+          forget(bomb->second);
+          known_bombs.erase(bomb);
+        }
+        Event filtered{};
+        filtered.type = EventType::BombExploded;
+        filtered.bomb_id = event.bomb_id;
+        // Destroyed robots are needed for the scores.
+        filtered.robots_destroyed = event.robots_destroyed;
+        for (const Position &position : event.blocks_destroyed) {
+          if (known_blocks.contains(position)) {
+            forgotten_blocks.push_back(position);
+            filtered.blocks_destroyed.push_back(position);
+          }
+        }
+        if (known || !filtered.robots_destroyed.empty() ||
+            !filtered.blocks_destroyed.empty())
+          out.push_back(std::move(filtered));
+        break;
+        }
+      case EventType::PlayerMoved:
+        {
+        std::optional<Position> &known = known_players[event.player_id];
+        if (event.player_id == viewer || current.contains(event.position) ||
+            (known && current.contains(*known))) {
+          known = event.position;
+          out.push_back(event);
+        }
+        break;
+        }
+      case EventType::BlockPlaced:
+        if (current.contains(event.position)) {
+          if (known_blocks.insert(event.position).second)
+            know(event.position);
+          out.push_back(event);
+        }
+        break;
+    }
+  }
+  for (const Position &position : forgotten_blocks) {
+    if (known_blocks.erase(position) > 0)
+      forget(position);
+  }
+
+  if (current != window) {
+    window = current;
+    sync_window(turn, out);
+  }
+}
+
+void InterestFilter::sync_window(uint16_t turn, std::vector<Event> &out) {
+  const Area &w = *window;
+  Event event{};
+  event.type = EventType::BlockPlaced;
+  index->for_each_block(turn, w, [&](const Position &position) {
+    if (known_blocks.insert(position).second) {
+      know(position);
+      event.position = position;
+      out.push_back(event);
+    }
+  });
+  // A bomb coming into view is announced with the turns it has left.
+  event.type = EventType::BombPlaced;
+  index->for_each_bomb(turn, w,
+    [&](Bomb::BombId bomb_id, const Position &position, uint16_t timer) {
+      if (known_bombs.emplace(bomb_id, position).second) {
+        know(position);
+        event.bomb_id = bomb_id;
+        event.position = position;
+        event.timer = timer;
+        out.push_back(event);
+      }
+    });
+  // Robots are shown where they are if either their real position or
+  // the one the client remembers comes into view.
+  event.type = EventType::PlayerMoved;
+  event.timer = 0;
+  for (uint16_t id = 0; id < index->players_count(); id++) {
+    const Position &real = index->position(turn, (Player::PlayerId) id);
+    std::optional<Position> &known = known_players[id];
+    if (known != real &&
+        (w.contains(real) || (known && w.contains(*known)))) {
+      known = real;
+      event.player_id = (Player::PlayerId) id;
+      event.position = real;
+      out.push_back(event);
+    }
+  }
+}
@@ -0,0 +1,208 @@
+#ifndef INTEREST_HPP
+#define INTEREST_HPP
+#include <vector>
+#include <array>
+#include <map>
+#include <set>
+#include <optional>
+#include <utility>
+#include <memory>
+#include <memory_resource>
+#include "messages.hpp"
+#include "program_options.hpp"
+
+// A rectangle of cells, both corners included.
+struct Area {
+  uint16_t x0, y0, x1, y1;
+
+  bool contains(const Position&) const;
+  bool operator==(const Area&) const = default;
+};
+
+// What the area-of-interest filters of one game need to know, built
+// once per turn by the game handler and shared by the filters of all
+// senders: the blocks and bombs at the end of every turn, the robots'
+// positions and the events of every turn indexed by the tiles of the
+// board they concern. Filters query their own window only instead of
+// keeping a copy of the board each.
+//
+// The board is a persistent quadtree: a turn copies the paths to the
+// cells it changes and shares the rest with the turn before, so every
+// turn's board stays readable for lagging senders. A turn's entries
+// are written before the turn is published and not changed after, so
+// filters read published turns without locking.
+class InterestIndex {
+public:
+  // Key of the events every filter gets, explosions destroying robots,
+  // which count towards everyone's scores.
+  static constexpr uint32_t EVERYWHERE = UINT32_MAX;
+
+  InterestIndex(const ServerOptions&);
+
+  InterestIndex(const InterestIndex&) = delete;
+  InterestIndex& operator=(const InterestIndex&) = delete;
+
+  // Indexes the events of the next turn, called by the game handler
+  // with every turn in order before publishing it.
+  void add_turn(uint16_t turn, const std::vector<Event>&);
+
+  // The window of the interest radius around a position.
+  Area area_around(const Position&) const;
+
+  // Tile of a position, the key its events are indexed under.
+  uint32_t tile(const Position&) const;
+
+  const Position &position(uint16_t turn, Player::PlayerId id) const {
+    return positions[turn][id];
+  }
+
+  uint8_t players_count() const {
+    return players;
+  }
+
+  // Appends the indices of the turn's events concerning the tiles
+  // the area overlaps, or the tile `key`, possibly more than once.
+  void events_in(uint16_t turn, const Area&, std::vector<uint32_t>&) const;
+  void events_at(uint16_t turn, uint32_t key, std::vector<uint32_t>&) const;
+
+  // Calls `f(position)` for each block and `f(id, position, timer)`
+  // for each bomb in the area at the end of the turn, with the turns
+  // the bomb has left.
+  template <typename F>
+  void for_each_block(uint16_t turn, const Area &area, F f) const {
+    visit(roots[turn], levels, 0, 0, area,
+      [&](const Position &at, const Node &cell) {
+        if (cell.block)
+          f(at);
+      });
+  }
+
+  template <typename F>
+  void for_each_bomb(uint16_t turn, const Area &area, F f) const {
+    visit(roots[turn], levels, 0, 0, area,
+      [&](const Position &at, const Node &cell) {
+        for (const BombEntry *bomb = cell.bombs; bomb; bomb = bomb->next)
+          f(bomb->id, at, (uint16_t) (bomb->explodes - turn));
+      });
+  }
+
+private:
+  struct BombEntry {
+    Bomb::BombId id;
+    // Turn in which the bomb explodes.
+    uint32_t explodes;
+    const BombEntry *next;
+  };
+
+  // Inner nodes have a child for each quarter holding anything, leaves
+  // are single cells. Nodes made in the turn being built are changed in
+  // place, older ones are copied first.
+  struct Node {
+    std::array<Node*, 4> children{};
+    bool block{false};
+    const BombEntry *bombs{nullptr};
+    uint16_t turn;
+  };
+
+  uint16_t radius, size_x, size_y, bomb_timer;
+  uint8_t players;
+  // The board's side is 2 to the power of `levels`, a tile's side is
+  // 2 to the power of `tile_shift`.
+  uint16_t levels, tile_shift;
+
+  std::unique_ptr<Node*[]> roots;
+  // Events of every turn by the tiles they concern, sorted.
+  std::unique_ptr<std::vector<std::pair<uint32_t, uint32_t>>[]> tiles;
+  std::unique_ptr<std::vector<Position>[]> positions;
+  // Nodes and bomb entries live as long as the index.
+  std::pmr::monotonic_buffer_resource memory;
+
+  // Only used by the game handler while building.
+  uint16_t building{0};
+  Node *root{nullptr};
+  std::map<Bomb::BombId, Position> live_bombs;
+
+  // Changes the cell at `at` with `f(Node&)`, copying the path to it
+  // and dropping the nodes left empty.
+  template <typename F>
+  void change(const Position &at, F f);
+  Node *make_node(const Node *copy);
+  const BombEntry *make_bomb(Bomb::BombId, uint32_t explodes, const BombEntry*);
+  void index(
+    std::vector<std::pair<uint32_t, uint32_t>>&,
+    const Position&,
+    uint32_t event
+  );
+
+  template <typename F>
+  static void visit(
+    const Node *node,
+    uint16_t level,
+    uint32_t x,
+    uint32_t y,
+    const Area &area,
+    const F &f
+    ) {
+    if (node == nullptr)
+      return;
+    if (level == 0) {
+      f(Position((uint16_t) x, (uint16_t) y), *node);
+      return;
+    }
+    uint32_t half = uint32_t(1) << (level - 1);
+    for (uint32_t quarter = 0; quarter < 4; quarter++) {
+      uint32_t qx = x + (quarter & 1) * half, qy = y + (quarter >> 1) * half;
+      if (qx <= area.x1 && area.x0 < qx + half &&
+          qy <= area.y1 && area.y0 < qy + half)
+        visit(
+          node->children[quarter], (uint16_t) (level - 1), qx, qy, area, f
+        );
+    }
+  }
+};
+
+// Area-of-interest filter for the turn stream of a single client.
+// It forwards only what happens within the interest radius (in both
+// axes) of the client's robot, taking it from the game's index. When
+// the robot moves, blocks, bombs and robots that come into view and
+// are unknown to the client are sent as synthetic events, bombs with
+// the turns they have left. Explosions destroying robots or blocks the
+// client knows about are always forwarded, so scores stay exact and
+// the client never keeps a block that no longer exists. The filter
+// keeps only what the client knows.
+class InterestFilter {
+public:
+  // Starts a new game watched from the robot of `viewer`.
+  void reset(Player::PlayerId viewer, const InterestIndex &index);
+
+  // Filters one published turn of the full stream and stores the
+  // events that should be sent to the client in `out`.
+  void filter(
+    uint16_t turn,
+    const std::vector<Event> &events,
+    std::vector<Event> &out
+  );
+
+private:
+  const InterestIndex *index{nullptr};
+  Player::PlayerId viewer{0};
+  std::optional<Area> window;
+
+  // The board as the client knows it, with the number of known blocks
+  // and bombs in each tile, whose events the filter has to look at
+  // also outside the window.
+  std::set<Position> known_blocks;
+  std::map<Bomb::BombId, Position> known_bombs;
+  std::array<std::optional<Position>, 256> known_players;
+  std::map<uint32_t, uint32_t> known_tiles;
+
+  // Scratch space of `filter`.
+  std::vector<uint32_t> selected;
+  std::vector<Position> forgotten_blocks;
+
+  void know(const Position&);
+  void forget(const Position&);
+  void sync_window(uint16_t turn, std::vector<Event>&);
+};
+
+#endif // INTEREST_HPP
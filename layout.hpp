@@ -0,0 +1,110 @@
+#ifndef LAYOUT_HPP
+#define LAYOUT_HPP
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <type_traits>
+#include "connections.hpp"
+
+// Compile-time description of fixed-size wire layouts. A layout lists
+// the members of a struct in the order they are sent: unsigned numbers,
+// sent in network order, or structs with a `WireLayout` of their own,
+// sent in place. Both directions are generated from the same list, so
+// they can not drift apart. The size of a layout is known at compile
+// time, a struct is read with a single call and written with a single
+// resize of the buffer.
+
+// Specialized for every struct used as a member of another layout.
+template<typename T>
+struct WireLayout;
+
+namespace layout {
+  template<typename M>
+  struct member;
+
+  template<typename C, typename T>
+  struct member<T C::*> {
+    using type = T;
+  };
+
+  template<auto Member>
+  using member_type = typename member<decltype(Member)>::type;
+
+  template<typename T>
+  constexpr T to_network(T number) {
+    if constexpr (sizeof(T) == 1 || std::endian::native == std::endian::big)
+      return number;
+    else if constexpr (sizeof(T) == 2)
+      return __builtin_bswap16(number);
+    else if constexpr (sizeof(T) == 4)
+      return __builtin_bswap32(number);
+    else
+      return __builtin_bswap64(number);
+  }
+
+  template<typename T>
+  constexpr size_t size() {
+    if constexpr (std::is_unsigned_v<T>)
+      return sizeof(T);
+    else
+      return WireLayout<T>::size;
+  }
+
+  template<typename T>
+  void encode(uint8_t *&out, const T &value) {
+    if constexpr (std::is_unsigned_v<T>) {
+      T number = to_network(value);
+      memcpy(out, &number, sizeof(number));
+      out += sizeof(number);
+    }
+    else {
+      WireLayout<T>::encode(out, value);
+    }
+  }
+
+  template<typename T>
+  void decode(const uint8_t *&in, T &value) {
+    if constexpr (std::is_unsigned_v<T>) {
+      memcpy(&value, in, sizeof(value));
+      value = to_network(value);
+      in += sizeof(value);
+    }
+    else {
+      WireLayout<T>::decode(in, value);
+    }
+  }
+} // namespace layout
+
+template<auto... Members>
+struct Layout {
+  static constexpr size_t size =
+    (layout::size<layout::member_type<Members>>() + ...);
+
+  template<typename T>
+  static void encode(uint8_t *&out, const T &value) {
+    (layout::encode(out, value.*Members), ...);
+  }
+
+  template<typename T>
+  static void decode(const uint8_t *&in, T &value) {
+    (layout::decode(in, value.*Members), ...);
+  }
+
+  template<typename T>
+  static void write(Buffer &buff, const T &value) {
+    size_t offset = buff.data.size();
+    buff.data.resize(offset + size);
+    uint8_t *out = buff.data.data() + offset;
+    encode(out, value);
+  }
+
+  template<typename T>
+  static void read(Connection &conn, T &value) {
+    uint8_t data[size];
+    conn.read_bytes(data, size);
+    const uint8_t *in = data;
+    decode(in, value);
+  }
+};
+
+#endif // LAYOUT_HPP
@@ -0,0 +1,160 @@
+#include "lock_profile.hpp"
+
+#ifdef PROFILE_LOCKS
+#include <array>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "metrics.hpp"
+
+struct LockSite {
+  const char *file;
+  uint32_t line;
+  Counter acquisitions;
+  Histogram wait_ns, hold_ns;
+};
+
+namespace {
+  // Sites are looked up without locking: they are only ever appended,
+  // each one before the count including it is published.
+  class LockSites {
+  public:
+    // Takes the acquisitions at sites beyond MAX_SITES, and the ones
+    // of threads that never locked at a known site.
+    LockSite other{"other", 0, {}, {}, {}};
+
+    LockSite &find(const std::source_location &where) {
+      size_t published = count.load(std::memory_order_acquire);
+      if (LockSite *site = search(where, 0, published))
+        return *site;
+      std::lock_guard lock(mutex);
+      size_t current = count.load(std::memory_order_relaxed);
+      if (LockSite *site = search(where, published, current))
+        return *site;
+      if (current == sites.size())
+        return other;
+      LockSite &site = sites[current];
+      site.file = where.file_name();
+      site.line = where.line();
+      count.store(current + 1, std::memory_order_release);
+      return site;
+    }
+
+    void dump(std::string &out) {
+      size_t published = count.load(std::memory_order_acquire);
+      const char *acquisitions = "robots_lock_acquisitions_total",
+                 *wait = "robots_lock_wait_ns",
+                 *hold = "robots_lock_hold_ns";
+      dump_type(out, acquisitions, "counter");
+      for_each(published, [&](const LockSite &site, const auto &labels) {
+        site.acquisitions.dump_series(out, acquisitions, labels);
+      });
+      dump_type(out, wait, "histogram");
+      for_each(published, [&](const LockSite &site, const auto &labels) {
+        site.wait_ns.dump_series(out, wait, labels);
+      });
+      dump_type(out, hold, "histogram");
+      for_each(published, [&](const LockSite &site, const auto &labels) {
+        site.hold_ns.dump_series(out, hold, labels);
+      });
+    }
+
+    ~LockSites() {
+      if (count.load(std::memory_order_acquire) == 0)
+        return;
+      std::string out;
+      dump(out);
+      std::cerr << out;
+    }
+
+  private:
+    static constexpr size_t MAX_SITES = 64;
+    std::array<LockSite, MAX_SITES> sites;
+    std::atomic<size_t> count{0};
+    std::mutex mutex;
+
+    LockSite *search(
+      const std::source_location &where,
+      size_t begin,
+      size_t end
+      ) {
+      for (size_t i = begin; i < end; i++) {
+        if (sites[i].line == where.line() &&
+            strcmp(sites[i].file, where.file_name()) == 0)
+          return &sites[i];
+      }
+      return nullptr;
+    }
+
+    template<typename F>
+    void for_each(size_t published, F f) {
+      for (size_t i = 0; i < published; i++) {
+        const char *file = strrchr(sites[i].file, '/');
+        std::string labels = "site=\"";
+        labels += file ? file + 1 : sites[i].file;
+        labels += ":" + std::to_string(sites[i].line) + "\"";
+        f(sites[i], labels);
+      }
+      if (other.acquisitions.value() > 0)
+        f(other, "site=\"other\"");
+    }
+  };
+
+  LockSites lock_sites;
+
+  // Site the calling thread last locked a mutex at.
+  thread_local LockSite *last_site = nullptr;
+
+  uint64_t nanoseconds(std::chrono::steady_clock::duration duration) {
+    return (uint64_t) std::chrono::duration_cast<
+      std::chrono::nanoseconds
+    >(duration).count();
+  }
+} // anonymous namespace
+
+void ProfiledMutex::lock_at(const std::source_location &where) {
+  last_site = &lock_sites.find(where);
+  lock();
+}
+
+void ProfiledMutex::lock() {
+  auto start = std::chrono::steady_clock::now();
+  mutex.lock();
+  locked_at = std::chrono::steady_clock::now();
+  holder = last_site ? last_site : &lock_sites.other;
+  holder->acquisitions.add();
+  holder->wait_ns.record(nanoseconds(locked_at - start));
+}
+
+void ProfiledMutex::unlock() {
+  LockSite *site = holder;
+  auto held = std::chrono::steady_clock::now() - locked_at;
+  mutex.unlock();
+  site->hold_ns.record(nanoseconds(held));
+}
+
+void dump_lock_profile(std::string &out) {
+  lock_sites.dump(out);
+}
+
+void dump_lock_profile_on_signal() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  std::thread([signals]{
+    int number;
+    sigwait(&signals, &number);
+    std::string out;
+    dump_lock_profile(out);
+    std::cerr << out << std::flush;
+    std::_Exit(128 + number);
+  }).detach();
+}
+
+#endif // PROFILE_LOCKS
@@ -0,0 +1,81 @@
+#ifndef LOCK_PROFILE_HPP
+#define LOCK_PROFILE_HPP
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <source_location>
+
+// Lock contention profiling. Built in with `make clean && make
+// PROFILE_LOCKS=1`, every place a profiled mutex is locked at counts
+// its acquisitions and records how long threads waited for the mutex
+// and how long they held it. The profile is dumped to stderr when the
+// process exits, also on SIGINT and SIGTERM, and the server serves it
+// on its stats port. Otherwise profiled mutexes are plain mutexes.
+
+#ifdef PROFILE_LOCKS
+
+struct LockSite;
+
+class ProfiledMutex {
+public:
+  ProfiledMutex() = default;
+
+  ProfiledMutex(const ProfiledMutex&) = delete;
+  ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+  void lock_at(const std::source_location&);
+
+  // Locks again for the site the calling thread last locked at, as
+  // condition variables and unique_lock::lock do.
+  void lock();
+
+  void unlock();
+
+private:
+  std::mutex mutex;
+  // Written by the holder only.
+  LockSite *holder{nullptr};
+  std::chrono::steady_clock::time_point locked_at;
+};
+
+// Mutexes are profiled also while condition variables wait.
+using ProfiledCondition = std::condition_variable_any;
+
+inline std::unique_lock<ProfiledMutex> profiled_lock(
+  ProfiledMutex &mutex,
+  const std::source_location &where = std::source_location::current()
+  ) {
+  mutex.lock_at(where);
+  return std::unique_lock<ProfiledMutex>(mutex, std::adopt_lock);
+}
+
+// Appends the profile in the format of the metrics.
+void dump_lock_profile(std::string&);
+
+// Makes SIGINT and SIGTERM end the process with a dump of the profile.
+// Called first in main, before any other thread, the logger's
+// included, is started: threads inherit the blocked signals and leave
+// them to a thread of their own, one started earlier could take them
+// and end the process without a dump.
+void dump_lock_profile_on_signal();
+
+#else
+
+using ProfiledMutex = std::mutex;
+using ProfiledCondition = std::condition_variable;
+
+inline std::unique_lock<ProfiledMutex> profiled_lock(
+  ProfiledMutex &mutex,
+  const std::source_location& = std::source_location::current()
+  ) {
+  return std::unique_lock<ProfiledMutex>(mutex);
+}
+
+inline void dump_lock_profile(std::string&) {}
+
+inline void dump_lock_profile_on_signal() {}
+
+#endif // PROFILE_LOCKS
+
+#endif // LOCK_PROFILE_HPP
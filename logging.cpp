@@ -0,0 +1,181 @@
+#include <iostream>
+#include <string>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <ctime>
+#include "logging.hpp"
+
+namespace {
+  // Bounded multi-producer ring buffer with a single consumer.
+  // Every cell carries a sequence number telling whether it is free
+  // for the producer of a given position or full for the consumer.
+  class LogRing {
+  public:
+    LogRing() {
+      for (size_t i = 0; i < CAPACITY; i++)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const LogRecord &record) {
+      size_t position = enqueue_position.load(std::memory_order_relaxed);
+      Cell *cell;
+      for (;;) {
+        cell = &cells[position & (CAPACITY - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+          if (enqueue_position.compare_exchange_weak(
+                position,
+                position + 1,
+                std::memory_order_relaxed))
+            break;
+        }
+        else if (sequence < position) {
+          // The consumer has not freed this cell yet, the ring is full.
+          return false;
+        }
+        else {
+          position = enqueue_position.load(std::memory_order_relaxed);
+        }
+      }
+      cell->record = record;
+      cell->sequence.store(position + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(LogRecord &record) {
+      Cell &cell = cells[dequeue_position & (CAPACITY - 1)];
+      if (cell.sequence.load(std::memory_order_acquire) != dequeue_position + 1)
+        return false;
+      record = cell.record;
+      cell.sequence.store(dequeue_position + CAPACITY, std::memory_order_release);
+      dequeue_position++;
+      return true;
+    }
+
+  private:
+    static constexpr size_t CAPACITY = 1024;
+
+    struct Cell {
+      std::atomic<size_t> sequence;
+      LogRecord record;
+    };
+
+    std::array<Cell, CAPACITY> cells;
+    alignas(64) std::atomic<size_t> enqueue_position{0};
+    alignas(64) size_t dequeue_position{0};
+  };
+
+  const char *level_name(LogLevel level) {
+    switch (level) {
+      case LogLevel::Debug:
+        return "DEBUG";
+      case LogLevel::Info:
+        return "INFO";
+      case LogLevel::Error:
+        return "ERROR";
+      default:
+        return "";
+    }
+  }
+
+  void format_record(const LogRecord &record, std::string &line) {
+    using namespace std::chrono;
+    time_t seconds = system_clock::to_time_t(record.time);
+    auto micros = duration_cast<microseconds>(
+      record.time.time_since_epoch()
+    ).count() % 1000000;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char stamp[32];
+    size_t len = strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+    snprintf(stamp + len, sizeof(stamp) - len, ".%06ld ", (long) micros);
+
+    line.clear();
+    line += stamp;
+    line += level_name(record.level);
+    line += ' ';
+    size_t arg = 0;
+    for (const char *c = record.format; *c; c++) {
+      if (c[0] == '{' && c[1] == '}' && arg < record.arg_count) {
+        const LogArg &value = record.args[arg++];
+        switch (value.kind) {
+          case LogArg::Kind::Signed:
+            line += std::to_string(value.i64);
+            break;
+          case LogArg::Kind::Unsigned:
+            line += std::to_string(value.u64);
+            break;
+          case LogArg::Kind::String:
+            line.append(value.text, value.length);
+            break;
+        }
+        c++;
+      }
+      else {
+        line += *c;
+      }
+    }
+    line += '\n';
+  }
+
+  // Owns the ring buffer and the thread writing records to stderr.
+  class LogWriter {
+  public:
+    LogWriter() : thread([this]{ run(); }) {}
+
+    ~LogWriter() {
+      stop.store(true, std::memory_order_release);
+      thread.join();
+      drain();
+      if (dropped > 0)
+        std::cerr << "[Logger] dropped " << dropped << " records\n";
+    }
+
+    void push(const LogRecord &record) {
+      if (!ring.push(record))
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void drain() {
+      std::lock_guard<std::mutex> lock(drain_mutex);
+      LogRecord record;
+      while (ring.pop(record)) {
+        format_record(record, line);
+        std::cerr << line;
+      }
+      std::cerr.flush();
+    }
+
+  private:
+    LogRing ring;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> stop{false};
+    std::mutex drain_mutex;
+    std::string line;
+    std::thread thread;
+
+    void run() {
+      while (!stop.load(std::memory_order_acquire)) {
+        drain();
+        // Polling keeps producers free of any wake-up syscalls.
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+    }
+  };
+
+  LogWriter &writer() {
+    static LogWriter writer;
+    return writer;
+  }
+} // anonymous namespace
+
+void Logger::push(const LogRecord &record) {
+  writer().push(record);
+}
+
+void Logger::flush() {
+  writer().drain();
+}
@@ -0,0 +1,127 @@
+#ifndef LOGGING_HPP
+#define LOGGING_HPP
+#include <string>
+#include <string_view>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+// Asynchronous logging. Callers pass a format string with `{}`
+// placeholders and the arguments separately, so nothing is formatted
+// when the level is disabled. Enabled records are copied into a ring
+// buffer and formatted and written out by a background thread, so
+// logging never blocks the calling thread. Records are dropped if the
+// ring buffer is full.
+
+enum struct LogLevel : uint8_t {
+  Debug = 0, Info = 1, Error = 2, Off = 3
+};
+
+#ifndef NDEBUG
+constexpr LogLevel MIN_LOG_LEVEL = LogLevel::Debug;
+#else
+constexpr LogLevel MIN_LOG_LEVEL = LogLevel::Info;
+#endif
+
+// Single argument of a log record, stored by value.
+struct LogArg {
+  enum struct Kind : uint8_t {
+    Signed, Unsigned, String
+  };
+  static constexpr size_t MAX_TEXT = 47;
+
+  Kind kind;
+  uint8_t length;
+  union {
+    int64_t i64;
+    uint64_t u64;
+    char text[MAX_TEXT];
+  };
+
+  LogArg() = default;
+
+  template<typename T>
+  requires std::is_integral_v<T>
+  LogArg(T value) {
+    if constexpr (std::is_signed_v<T>) {
+      kind = Kind::Signed;
+      i64 = value;
+    }
+    else {
+      kind = Kind::Unsigned;
+      u64 = value;
+    }
+  }
+
+  // Longer strings are truncated.
+  LogArg(std::string_view value) : kind(Kind::String) {
+    length = (uint8_t) std::min(value.size(), MAX_TEXT);
+    memcpy(text, value.data(), length);
+  }
+
+  LogArg(const std::string &value) : LogArg(std::string_view(value)) {}
+
+  LogArg(const char *value) : LogArg(std::string_view(value)) {}
+};
+
+struct LogRecord {
+  static constexpr size_t MAX_ARGS = 4;
+
+  std::chrono::system_clock::time_point time;
+  LogLevel level;
+  uint8_t arg_count;
+  // Must point to a string literal, it is read by the logging thread.
+  const char *format;
+  std::array<LogArg, MAX_ARGS> args;
+};
+
+class Logger {
+public:
+  static bool enabled(LogLevel level) {
+    return level >= MIN_LOG_LEVEL &&
+      level >= current_level.load(std::memory_order_relaxed);
+  }
+
+  static void set_level(LogLevel level) {
+    current_level.store(level, std::memory_order_relaxed);
+  }
+
+  template<typename... Args>
+  static void log(LogLevel level, const char *format, const Args &...args) {
+    static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS);
+    if (!enabled(level))
+      return;
+    LogRecord record;
+    record.time = std::chrono::system_clock::now();
+    record.level = level;
+    record.format = format;
+    record.arg_count = (uint8_t) sizeof...(Args);
+    size_t i = 0;
+    ((record.args[i++] = LogArg(args)), ...);
+    push(record);
+  }
+
+  // Writes out all queued records, used before the process exits.
+  static void flush();
+
+private:
+  static inline std::atomic<LogLevel> current_level{MIN_LOG_LEVEL};
+
+  static void push(const LogRecord&);
+};
+
+template<typename... Args>
+void debug(const char *format, const Args &...args) {
+  if constexpr (MIN_LOG_LEVEL <= LogLevel::Debug)
+    Logger::log(LogLevel::Debug, format, args...);
+}
+
+template<typename... Args>
+void info(const char *format, const Args &...args) {
+  Logger::log(LogLevel::Info, format, args...);
+}
+
+#endif // LOGGING_HPP
@@ -1,293 +1,913 @@
-#include <string>
-#include <vector>
-#include "messages.hpp"
-#include "connections.hpp"
-
-bool Position::operator<(const Position &other) const {
-  if (x == other.x)
-    return y < other.y;
-  return x < other.x;
-}
-
-Position::Position(uint16_t x, uint16_t y) : x(x), y(y) {}
-
-Position::Position(Connection &conn) {
-  conn.read16(x)
-      .read16(y);
-}
-
-void Position::serialize(Buffer &buff) const {
-  buff.write16(x)
-      .write16(y);
-}
-
-Player::Player(std::string name, std::string address)
-: name(name), address(address) {}
-
-Player::Player(Connection &conn) {
-  conn.read_string(name)
-      .read_string(address);
-}
-
-void Player::serialize(Buffer &buff) const {
-  buff.write_string(name)
-      .write_string(address);
-}
-
-Bomb::Bomb(Position position, uint16_t timer)
-: position(position), timer(timer) {}
-
-void Bomb::serialize(Buffer &buff) const {
-  position.serialize(buff);
-  buff.write16(timer);
-}
-
-ClientToServer::ClientToServer(Connection &conn) {
-  uint8_t u8;
-  conn.read8(u8);
-  if (u8 > static_cast<uint8_t>(ClientToServerType::MAX))
-    throw ClientReadError();
-  type = ClientToServerType(u8);
-  switch (type) {
-    case ClientToServerType::Join:
-      conn.read_string(name);
-      break;
-    case ClientToServerType::Move:
-      conn.read8(u8);
-      if (u8 > static_cast<uint8_t>(Direction::MAX))
-        throw ServerReadError();
-      direction = Direction(u8);
-      break;
-    default:
-      break;
-  }
-}
-
-void ClientToServer::serialize(Buffer &buff) const {
-  buff.write8(static_cast<uint8_t>(type));
-  switch (type) {
-    case ClientToServerType::Join:
-      buff.write_string(name);
-      break;
-    case ClientToServerType::Move:
-      buff.write8(static_cast<uint8_t>(direction));
-      break;
-    default:
-      break;
-  }
-}
-
-Event::Event(Connection &conn) {
-  uint8_t u8;
-  conn.read8(u8);
-  if (u8 > static_cast<uint8_t>(EventType::MAX))
-    throw ServerReadError();
-  type = EventType(u8);
-  switch (type) {
-    case EventType::BombPlaced:
-      conn.read32(bomb_id);
-      position = Position(conn);
-      break;
-    case EventType::BombExploded:
-      conn.read32(bomb_id);
-      uint32_t len;
-      conn.read32(len);
-      for (uint32_t i = 0; i < len; i++) {
-        conn.read8(player_id);
-        robots_destroyed.push_back(player_id);
-      }
-      conn.read32(len);
-      for (uint32_t i = 0; i < len; i++) {
-        position = Position(conn);
-        blocks_destroyed.push_back(position);
-      }
-      break;
-    case EventType::PlayerMoved:
-      conn.read8(player_id);
-      position = Position(conn);
-      break;
-    case EventType::BlockPlaced:
-      position = Position(conn);
-      break;
-  }
-}
-
-void Event::serialize(Buffer& buff) const {
-  buff.write8(static_cast<uint8_t>(type));
-  switch (type) {
-    case EventType::BombPlaced:
-      buff.write32(bomb_id);
-      position.serialize(buff);
-      break;
-    case EventType::BombExploded:
-      buff.write32(bomb_id)
-          .write32((uint32_t) robots_destroyed.size());
-      for (const auto &id : robots_destroyed)
-        buff.write8(id);
-      buff.write32((uint32_t) blocks_destroyed.size());
-      for (const Position &position : blocks_destroyed)
-        position.serialize(buff);
-      break;
-    case EventType::PlayerMoved:
-      buff.write8(player_id);
-      position.serialize(buff);
-      break;
-    case EventType::BlockPlaced:
-      position.serialize(buff);
-      break;
-  }
-}
-
-ServerToClient::ServerToClient(Connection &conn) {
-  uint8_t u8;
-  conn.read8(u8);
-  if (u8 > static_cast<uint8_t>(ServerToClientType::MAX))
-    throw ServerReadError();
-  type = ServerToClientType(u8);
-  uint32_t len;
-  switch (type) {
-    case ServerToClientType::Hello:
-      conn.read_string(server_name)
-          .read8(player_count)
-          .read16(size_x)
-          .read16(size_y)
-          .read16(game_length)
-          .read16(explosion_radius)
-          .read16(bomb_timer);
-      break;
-    case ServerToClientType::AcceptedPlayer:
-      conn.read8(player_id);
-      player = Player(conn);
-      break;
-    case ServerToClientType::GameStarted:
-      conn.read32(len);
-      for (uint32_t i = 0; i < len; i++) {
-        conn.read8(player_id);
-        player = Player(conn);
-        players[player_id] = player;
-      }
-      break;
-    case ServerToClientType::Turn:
-      conn.read16(turn)
-        .read32(len);
-      for (uint32_t i = 0; i < len; i++) {
-        Event event(conn);
-        events.push_back(event);
-      }
-      break;
-    case ServerToClientType::GameEnded:
-      conn.read32(len);
-      for (uint32_t i = 0; i < len; i++) {
-        Player::Score score;
-        conn.read8(player_id)
-            .read32(score);
-        scores[player_id] = score;
-      }
-      break;
-  }
-}
-
-void ServerToClient::serialize(Buffer& buff) const {
-  buff.write8(static_cast<uint8_t>(type));
-  switch (type) {
-    case ServerToClientType::Hello:
-      buff.write_string(server_name)
-          .write8(player_count)
-          .write16(size_x)
-          .write16(size_y)
-          .write16(game_length)
-          .write16(explosion_radius)
-          .write16(bomb_timer);
-      break;
-    case ServerToClientType::AcceptedPlayer:
-      buff.write8(player_id);
-      player.serialize(buff);
-      break;
-    case ServerToClientType::GameStarted:
-      buff.write32((uint32_t) players.size());
-      for (const auto &[id, player] : players) {
-        buff.write8(id);
-        player.serialize(buff);
-      }
-      break;
-    case ServerToClientType::Turn:
-      buff.write16(turn)
-          .write32((uint32_t) events.size());
-      for (const Event &event : events)
-        event.serialize(buff);
-      break;
-    case ServerToClientType::GameEnded:
-      buff.write32((uint32_t) scores.size());
-      for (const auto &[id, score] : scores) {
-        buff.write8(id)
-            .write32(score);
-      }
-  }
-}
-
-GUIToClient::GUIToClient(Connection &conn) {
-  uint8_t u8;
-  conn.read8(u8);
-  if (u8 > static_cast<uint8_t>(GUIToClientType::MAX))
-    throw GUIReadError();
-  type = GUIToClientType(u8);
-  switch (type) {
-    case GUIToClientType::Move:
-      conn.read8(u8);
-      if (u8 > static_cast<uint8_t>(Direction::MAX))
-        throw ServerReadError();
-      direction = Direction(u8);
-      break;
-    default:
-      break;
-  }
-}
-
-void ClientToGUI::serialize(Buffer &buff) const {
-  buff.write8(static_cast<uint8_t>(type))
-      .write_string(server_name);
-  switch (type) {
-    case ClientToGUIType::Lobby:
-      buff.write8(player_count)
-          .write16(size_x)
-          .write16(size_y)
-          .write16(game_length)
-          .write16(explosion_radius)
-          .write16(bomb_timer)
-          .write32((uint32_t) players.size());
-      for (const auto &[id, player] : players) {
-        buff.write8(id);
-        player.serialize(buff);
-      }
-      break;
-    case ClientToGUIType::Game:
-      buff.write16(size_x)
-          .write16(size_y)
-          .write16(game_length)
-          .write16(turn)
-          .write32((uint32_t) players.size());
-      for (const auto &[id, player] : players) {
-        buff.write8(id);
-        player.serialize(buff);
-      }
-      buff.write32((uint32_t) player_positions.size());
-      for (const auto &[id, position] : player_positions) {
-        buff.write8(id);
-        position.serialize(buff);
-      }
-      buff.write32((uint32_t) blocks.size());
-      for (const Position &position : blocks)
-        position.serialize(buff);
-      buff.write32((uint32_t) bombs.size());
-      for (const auto &[id, bomb] : bombs)
-        bomb.serialize(buff);
-      buff.write32((uint32_t) explosions.size());
-      for (const Position &position : explosions)
-        position.serialize(buff);
-      buff.write32((uint32_t) scores.size());
-      for (const auto &[id, score] : scores) {
-        buff.write8(id)
-            .write32(score);
-      }
-  }
-}
\ No newline at end of file
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "messages.hpp"
+#include "connections.hpp"
+#include "layout.hpp"
+#include "zobrist.hpp"
+
+template<>
+struct WireLayout<Position> : Layout<&Position::x, &Position::y> {};
+
+template<>
+struct WireLayout<Bomb> : Layout<&Bomb::position, &Bomb::timer> {};
+
+namespace {
+  // Zigzag encoding maps small negative differences to small
+  // unsigned numbers, so they fit in short varints.
+  uint32_t zigzag(int32_t value) {
+    return (uint32_t) ((value << 1) ^ (value >> 31));
+  }
+
+  int32_t unzigzag(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+  }
+
+  uint16_t read_delta16(Connection &conn, uint16_t base) {
+    uint32_t encoded;
+    conn.read_varint(encoded);
+    if (encoded > UINT16_MAX)
+      throw ServerReadError();
+    return (uint16_t) (base + unzigzag(encoded));
+  }
+
+  using Bombs = std::vector<std::pair<Bomb::BombId, Bomb>>;
+
+  // Fixed-size parts of messages.
+  using HelloLayout = Layout<
+    &ServerToClient::player_count, &ServerToClient::size_x,
+    &ServerToClient::size_y, &ServerToClient::game_length,
+    &ServerToClient::explosion_radius, &ServerToClient::bomb_timer
+  >;
+  using ResumeLayout = Layout<&ClientToServer::token, &ClientToServer::turn>;
+  using StateHashLayout =
+    Layout<&ServerToClient::turn, &ServerToClient::state_hash>;
+  using BombPlacedLayout = Layout<&Event::bomb_id, &Event::position>;
+  using PlayerMovedLayout = Layout<&Event::player_id, &Event::position>;
+  using BombLayout = Layout<
+    &Bombs::value_type::first, &Bombs::value_type::second
+  >;
+  using LobbyLayout = Layout<
+    &ClientToGUI::player_count, &ClientToGUI::size_x, &ClientToGUI::size_y,
+    &ClientToGUI::game_length, &ClientToGUI::explosion_radius,
+    &ClientToGUI::bomb_timer
+  >;
+  using GameLayout = Layout<
+    &ClientToGUI::size_x, &ClientToGUI::size_y,
+    &ClientToGUI::game_length, &ClientToGUI::turn
+  >;
+  static_assert(WireLayout<Position>::size == 4);
+  static_assert(BombLayout::size == 10);
+  static_assert(HelloLayout::size == 11);
+
+  // Most bytes a field may take in either protocol.
+  constexpr uint64_t LENGTH_BYTES = 5;
+  constexpr uint64_t POSITION_BYTES = 6;
+  constexpr uint64_t STRING_BYTES = 256;
+  constexpr uint64_t PLAYER_BYTES = 1 + 2 * STRING_BYTES;
+  // An explosion stops at the first block of each ray.
+  constexpr uint64_t BLOCKS_PER_EXPLOSION = BlockBoard::RAYS;
+
+  // Compact run type of bombs sent with a timer of their own.
+  constexpr uint8_t TIMED_BOMBS = static_cast<uint8_t>(EventType::MAX) + 1;
+
+  uint8_t compact_type(const Event &event) {
+    if (event.type == EventType::BombPlaced && event.timer != 0)
+      return TIMED_BOMBS;
+    return static_cast<uint8_t>(event.type);
+  }
+
+  // Bytes a message may take after its type byte.
+  size_t message_budget(const ParseLimits &limits, ServerToClientType type) {
+    // Bomb exploded is the longest event, in the Compact protocol
+    // every event may also start a run of its own.
+    uint64_t event_bytes = 1 + LENGTH_BYTES + LENGTH_BYTES + LENGTH_BYTES +
+      limits.players + LENGTH_BYTES + BLOCKS_PER_EXPLOSION * POSITION_BYTES;
+    switch (type) {
+      case ServerToClientType::Hello:
+        return STRING_BYTES + HelloLayout::size;
+      case ServerToClientType::AcceptedPlayer:
+        return PLAYER_BYTES;
+      case ServerToClientType::GameStarted:
+        return LENGTH_BYTES + limits.players * PLAYER_BYTES;
+      case ServerToClientType::Turn:
+        return 2 * LENGTH_BYTES + limits.events * event_bytes;
+      case ServerToClientType::GameEnded:
+        return LENGTH_BYTES + limits.players * (1 + LENGTH_BYTES);
+      case ServerToClientType::ProtocolAccepted:
+        return 1;
+      case ServerToClientType::Session:
+        return 8;
+      case ServerToClientType::StateHash:
+        return StateHashLayout::size;
+      case ServerToClientType::Snapshot:
+        return 2 + 5 * LENGTH_BYTES +
+          limits.players * (1 + WireLayout<Position>::size) +
+          2 * limits.cells * WireLayout<Position>::size +
+          limits.bombs * BombLayout::size + limits.players * (1 + 4);
+    }
+    return 0;
+  }
+
+  // Checks a count read from the stream against its bound and against
+  // the bytes left of the message, each item taking at least
+  // `item_bytes`, before anything is reserved for the items.
+  uint32_t check_count(
+    const Connection &conn,
+    uint32_t len,
+    uint64_t max,
+    uint64_t item_bytes
+    ) {
+    if (len > max || len * item_bytes > conn.budget_left())
+      throw ServerReadError();
+    return len;
+  }
+
+  // Counts within their bounds may still be large on big boards, room
+  // for more items is made only as they arrive.
+  constexpr size_t MAX_RESERVED = 4096;
+
+  // The board kept for the GUI is reserved up to this many items per
+  // list, bigger games grow the lists on the way.
+  constexpr uint64_t MAX_RESERVED_STATE = 1 << 16;
+
+  template<typename T>
+  void reserve(std::vector<T> &items, uint32_t len) {
+    items.reserve(std::min<size_t>(len, MAX_RESERVED));
+  }
+
+  Position read_position(Connection &conn, const ParseLimits &limits) {
+    Position position(conn);
+    return limits.check(position);
+  }
+
+  // Positions are pairs of 16-bit numbers, arrays of them are
+  // converted to and from network order in bulk.
+  static_assert(sizeof(Position) == 2 * sizeof(uint16_t));
+
+  void write_positions(Buffer &buff, const std::vector<Position> &positions) {
+    buff.write16_array(
+      (const uint16_t *) positions.data(), 2 * positions.size()
+    );
+  }
+
+  void read_positions(
+    Connection &conn,
+    std::vector<Position> &positions,
+    uint32_t len,
+    const ParseLimits &limits
+    ) {
+    for (size_t left = len; left > 0;) {
+      size_t offset = positions.size();
+      size_t chunk = std::min(left, MAX_RESERVED);
+      positions.resize(offset + chunk);
+      conn.read16_array((uint16_t *) &positions[offset], 2 * chunk);
+      for (size_t i = offset; i < positions.size(); i++)
+        limits.check(positions[i]);
+      left -= chunk;
+    }
+  }
+
+  Bombs::iterator lower_bound_bomb(Bombs &bombs, Bomb::BombId id) {
+    return std::lower_bound(
+      bombs.begin(), bombs.end(), id,
+      [](const Bombs::value_type &bomb, Bomb::BombId id) {
+        return bomb.first < id;
+      }
+    );
+  }
+} // anonymous namespace
+
+bool Position::operator<(const Position &other) const {
+  if (x == other.x)
+    return y < other.y;
+  return x < other.x;
+}
+
+Position::Position(uint16_t x, uint16_t y) : x(x), y(y) {}
+
+Position::Position(Connection &conn) {
+  WireLayout<Position>::read(conn, *this);
+}
+
+void Position::serialize(Buffer &buff) const {
+  WireLayout<Position>::write(buff, *this);
+}
+
+Player::Player(std::string name, std::string address)
+: name(name), address(address) {}
+
+Player::Player(Connection &conn) {
+  conn.read_string(name)
+      .read_string(address);
+}
+
+void Player::serialize(Buffer &buff) const {
+  buff.write_string(name)
+      .write_string(address);
+}
+
+Bomb::Bomb(Position position, uint16_t timer)
+: position(position), timer(timer) {}
+
+void Bomb::serialize(Buffer &buff) const {
+  WireLayout<Bomb>::write(buff, *this);
+}
+
+ParseLimits::ParseLimits(
+  uint8_t player_count,
+  uint16_t size_x,
+  uint16_t size_y,
+  uint16_t bomb_timer)
+  : size_x(size_x),
+    size_y(size_y),
+    bomb_timer(bomb_timer),
+    players(player_count),
+    cells((uint64_t) size_x * size_y),
+    // Every robot places at most one bomb a turn.
+    bombs(players * ((uint64_t) bomb_timer + 1)),
+    // A turn holds at most the events of the robots, of exploding bombs
+    // and of respawns. The first turn places the initial blocks and an
+    // area-of-interest filter may announce every known block and bomb.
+    events(2 * cells + bombs + 4 * players) {}
+
+const Position &ParseLimits::check(const Position &position) const {
+  if (position.x >= size_x || position.y >= size_y)
+    throw ServerReadError();
+  return position;
+}
+
+void Codec::reset() {
+  cursor = Position(0, 0);
+  last_bomb = 0;
+  players.fill(Position(0, 0));
+}
+
+void Codec::write_position(
+  Buffer &buff,
+  Position &base,
+  const Position &position
+  ) {
+  buff.write_varint(zigzag((int16_t) (position.x - base.x)))
+      .write_varint(zigzag((int16_t) (position.y - base.y)));
+  base = position;
+}
+
+Position Codec::read_position(Connection &conn, Position &base) {
+  uint16_t x = read_delta16(conn, base.x);
+  uint16_t y = read_delta16(conn, base.y);
+  base = Position(x, y);
+  return base;
+}
+
+void Codec::write_bomb_id(Buffer &buff, Bomb::BombId bomb_id) {
+  buff.write_varint(zigzag((int32_t) (bomb_id - last_bomb)));
+  last_bomb = bomb_id;
+}
+
+Bomb::BombId Codec::read_bomb_id(Connection &conn) {
+  uint32_t encoded;
+  conn.read_varint(encoded);
+  last_bomb += (Bomb::BombId) unzigzag(encoded);
+  return last_bomb;
+}
+
+void Codec::write_length(Buffer &buff, size_t len) const {
+  if (version == ProtocolVersion::Compact)
+    buff.write_varint((uint32_t) len);
+  else
+    buff.write32((uint32_t) len);
+}
+
+uint32_t Codec::read_length(Connection &conn) const {
+  uint32_t len;
+  if (version == ProtocolVersion::Compact)
+    conn.read_varint(len);
+  else
+    conn.read32(len);
+  return len;
+}
+
+ClientToServer::ClientToServer(Connection &conn, uint8_t u8) {
+  if (u8 > static_cast<uint8_t>(ClientToServerType::MAX))
+    throw ClientReadError();
+  type = ClientToServerType(u8);
+  switch (type) {
+    case ClientToServerType::Join:
+      conn.read_string(name);
+      break;
+    case ClientToServerType::Move:
+      conn.read8(u8);
+      if (u8 > static_cast<uint8_t>(Direction::MAX))
+        throw ServerReadError();
+      direction = Direction(u8);
+      break;
+    case ClientToServerType::Negotiate:
+      conn.read8(u8);
+      if (u8 == 0)
+        throw ClientReadError();
+      // Clients may know newer versions, settle on the best common one.
+      if (u8 > static_cast<uint8_t>(ProtocolVersion::MAX))
+        u8 = static_cast<uint8_t>(ProtocolVersion::MAX);
+      version = ProtocolVersion(u8);
+      break;
+    case ClientToServerType::Resume:
+      ResumeLayout::read(conn, *this);
+      break;
+    default:
+      break;
+  }
+}
+
+void ClientToServer::serialize(Buffer &buff) const {
+  buff.write8(static_cast<uint8_t>(type));
+  switch (type) {
+    case ClientToServerType::Join:
+      buff.write_string(name);
+      break;
+    case ClientToServerType::Move:
+      buff.write8(static_cast<uint8_t>(direction));
+      break;
+    case ClientToServerType::Negotiate:
+      buff.write8(static_cast<uint8_t>(version));
+      break;
+    case ClientToServerType::Resume:
+      ResumeLayout::write(buff, *this);
+      break;
+    default:
+      break;
+  }
+}
+
+Event::Event(Connection &conn, const ParseLimits &limits) {
+  uint8_t u8;
+  conn.read8(u8);
+  if (u8 > static_cast<uint8_t>(EventType::MAX))
+    throw ServerReadError();
+  type = EventType(u8);
+  switch (type) {
+    case EventType::BombPlaced:
+      BombPlacedLayout::read(conn, *this);
+      limits.check(position);
+      break;
+    case EventType::BombExploded:
+      conn.read32(bomb_id);
+      uint32_t len;
+      conn.read32(len);
+      reserve(robots_destroyed, check_count(conn, len, limits.players, 1));
+      for (uint32_t i = 0; i < len; i++) {
+        conn.read8(player_id);
+        robots_destroyed.push_back(player_id);
+      }
+      conn.read32(len);
+      check_count(conn, len, BLOCKS_PER_EXPLOSION, 4);
+      read_positions(conn, blocks_destroyed, len, limits);
+      break;
+    case EventType::PlayerMoved:
+      PlayerMovedLayout::read(conn, *this);
+      limits.check(position);
+      break;
+    case EventType::BlockPlaced:
+      position = read_position(conn, limits);
+      break;
+  }
+}
+
+void Event::serialize(Buffer& buff) const {
+  buff.write8(static_cast<uint8_t>(type));
+  switch (type) {
+    case EventType::BombPlaced:
+      BombPlacedLayout::write(buff, *this);
+      break;
+    case EventType::BombExploded:
+      buff.write32(bomb_id)
+          .write32((uint32_t) robots_destroyed.size());
+      for (const auto &id : robots_destroyed)
+        buff.write8(id);
+      buff.write32((uint32_t) blocks_destroyed.size());
+      write_positions(buff, blocks_destroyed);
+      break;
+    case EventType::PlayerMoved:
+      PlayerMovedLayout::write(buff, *this);
+      break;
+    case EventType::BlockPlaced:
+      position.serialize(buff);
+      break;
+  }
+}
+
+Event::Event(Connection &conn, EventType type, Codec &codec) : type(type) {
+  const ParseLimits &limits = codec.limits;
+  uint32_t len;
+  switch (type) {
+    case EventType::BombPlaced:
+      bomb_id = codec.read_bomb_id(conn);
+      position = limits.check(codec.read_position(conn, codec.cursor));
+      break;
+    case EventType::BombExploded:
+      bomb_id = codec.read_bomb_id(conn);
+      conn.read_varint(len);
+      reserve(robots_destroyed, check_count(conn, len, limits.players, 1));
+      for (uint32_t i = 0; i < len; i++) {
+        conn.read8(player_id);
+        robots_destroyed.push_back(player_id);
+      }
+      conn.read_varint(len);
+      reserve(
+        blocks_destroyed, check_count(conn, len, BLOCKS_PER_EXPLOSION, 2)
+      );
+      for (uint32_t i = 0; i < len; i++) {
+        blocks_destroyed.push_back(
+          limits.check(codec.read_position(conn, codec.cursor))
+        );
+      }
+      break;
+    case EventType::PlayerMoved:
+      conn.read8(player_id);
+      position = limits.check(
+        codec.read_position(conn, codec.players[player_id])
+      );
+      break;
+    case EventType::BlockPlaced:
+      position = limits.check(codec.read_position(conn, codec.cursor));
+      break;
+  }
+}
+
+void Event::serialize_compact(Buffer &buff, Codec &codec) const {
+  switch (type) {
+    case EventType::BombPlaced:
+      codec.write_bomb_id(buff, bomb_id);
+      codec.write_position(buff, codec.cursor, position);
+      if (timer != 0)
+        buff.write_varint(timer);
+      break;
+    case EventType::BombExploded:
+      codec.write_bomb_id(buff, bomb_id);
+      buff.write_varint((uint32_t) robots_destroyed.size());
+      for (const auto &id : robots_destroyed)
+        buff.write8(id);
+      buff.write_varint((uint32_t) blocks_destroyed.size());
+      for (const Position &position : blocks_destroyed)
+        codec.write_position(buff, codec.cursor, position);
+      break;
+    case EventType::PlayerMoved:
+      buff.write8(player_id);
+      codec.write_position(buff, codec.players[player_id], position);
+      break;
+    case EventType::BlockPlaced:
+      codec.write_position(buff, codec.cursor, position);
+      break;
+  }
+}
+
+ServerToClient::ServerToClient(Connection &conn, Codec &codec) {
+  const ParseLimits &limits = codec.limits;
+  uint8_t u8;
+  conn.set_budget(1);
+  conn.read8(u8);
+  if (u8 > static_cast<uint8_t>(ServerToClientType::MAX))
+    throw ServerReadError();
+  type = ServerToClientType(u8);
+  conn.set_budget(message_budget(limits, type));
+  uint32_t len;
+  switch (type) {
+    case ServerToClientType::Hello:
+      conn.read_string(server_name);
+      HelloLayout::read(conn, *this);
+      if ((uint64_t) size_x * size_y > ParseLimits::MAX_CELLS)
+        throw ServerReadError();
+      codec.limits = ParseLimits(player_count, size_x, size_y, bomb_timer);
+      break;
+    case ServerToClientType::AcceptedPlayer:
+      conn.read8(player_id);
+      player = Player(conn);
+      break;
+    case ServerToClientType::GameStarted:
+      codec.reset();
+      len = check_count(conn, codec.read_length(conn), limits.players, 3);
+      for (uint32_t i = 0; i < len; i++) {
+        conn.read8(player_id);
+        player = Player(conn);
+        players[player_id] = player;
+      }
+      break;
+    case ServerToClientType::Turn:
+      if (codec.version == ProtocolVersion::Compact) {
+        uint32_t u32, runs;
+        conn.read_varint(u32)
+            .read_varint(runs);
+        if (u32 > UINT16_MAX)
+          throw ServerReadError();
+        turn = (uint16_t) u32;
+        check_count(conn, runs, limits.events, 3);
+        // Events come in runs sharing the same type.
+        for (uint32_t run = 0; run < runs; run++) {
+          conn.read8(u8)
+              .read_varint(len);
+          bool timed = u8 == TIMED_BOMBS;
+          if (u8 > static_cast<uint8_t>(EventType::MAX) && !timed)
+            throw ServerReadError();
+          check_count(conn, len, limits.events - events.size(), 2);
+          for (uint32_t i = 0; i < len; i++) {
+            Event &event = events.emplace_back(
+              conn, timed ? EventType::BombPlaced : EventType(u8), codec
+            );
+            if (!timed)
+              continue;
+            uint32_t timer;
+            conn.read_varint(timer);
+            if (timer == 0 || timer > limits.bomb_timer)
+              throw ServerReadError();
+            event.timer = (uint16_t) timer;
+          }
+        }
+        break;
+      }
+      conn.read16(turn)
+        .read32(len);
+      reserve(events, check_count(conn, len, limits.events, 5));
+      for (uint32_t i = 0; i < len; i++)
+        events.emplace_back(conn, limits);
+      break;
+    case ServerToClientType::GameEnded:
+      len = check_count(conn, codec.read_length(conn), limits.players, 2);
+      for (uint32_t i = 0; i < len; i++) {
+        Player::Score score;
+        conn.read8(player_id);
+        if (codec.version == ProtocolVersion::Compact)
+          conn.read_varint(score);
+        else
+          conn.read32(score);
+        scores[player_id] = score;
+      }
+      break;
+    case ServerToClientType::ProtocolAccepted:
+      conn.read8(u8);
+      if (u8 == 0 || u8 > static_cast<uint8_t>(ProtocolVersion::MAX))
+        throw ServerReadError();
+      version = ProtocolVersion(u8);
+      // Every following message uses the accepted protocol.
+      codec.version = version;
+      break;
+    case ServerToClientType::Session:
+      conn.read64(token);
+      break;
+    case ServerToClientType::StateHash:
+      StateHashLayout::read(conn, *this);
+      break;
+    case ServerToClientType::Snapshot:
+      conn.read16(turn);
+      len = check_count(conn, codec.read_length(conn), limits.players, 5);
+      for (uint32_t i = 0; i < len; i++) {
+        conn.read8(player_id);
+        player_positions[player_id] = read_position(conn, limits);
+      }
+      len = check_count(conn, codec.read_length(conn), limits.cells, 4);
+      read_positions(conn, blocks, len, limits);
+      len = check_count(conn, codec.read_length(conn), limits.bombs, 10);
+      reserve(bombs, len);
+      for (uint32_t i = 0; i < len; i++) {
+        BombLayout::read(conn, bombs.emplace_back());
+        limits.check(bombs.back().second.position);
+      }
+      len = check_count(conn, codec.read_length(conn), limits.cells, 4);
+      read_positions(conn, explosions, len, limits);
+      len = check_count(conn, codec.read_length(conn), limits.players, 5);
+      for (uint32_t i = 0; i < len; i++) {
+        Player::Score score;
+        conn.read8(player_id)
+            .read32(score);
+        scores[player_id] = score;
+      }
+      break;
+  }
+}
+
+void ServerToClient::serialize(Buffer& buff, Codec &codec) const {
+  buff.write8(static_cast<uint8_t>(type));
+  switch (type) {
+    case ServerToClientType::Hello:
+      buff.write_string(server_name);
+      HelloLayout::write(buff, *this);
+      break;
+    case ServerToClientType::AcceptedPlayer:
+      buff.write8(player_id);
+      player.serialize(buff);
+      break;
+    case ServerToClientType::GameStarted:
+      codec.reset();
+      codec.write_length(buff, players.size());
+      for (const auto &[id, player] : players) {
+        buff.write8(id);
+        player.serialize(buff);
+      }
+      break;
+    case ServerToClientType::Turn:
+      if (codec.version == ProtocolVersion::Compact) {
+        uint32_t runs = 0;
+        for (size_t i = 0; i < events.size(); i++) {
+          if (i == 0 || compact_type(events[i]) != compact_type(events[i - 1]))
+            runs++;
+        }
+        buff.write_varint(turn)
+            .write_varint(runs);
+        for (size_t i = 0; i < events.size();) {
+          size_t j = i;
+          while (j < events.size() &&
+                 compact_type(events[j]) == compact_type(events[i]))
+            j++;
+          buff.write8(compact_type(events[i]))
+              .write_varint((uint32_t) (j - i));
+          for (; i < j; i++)
+            events[i].serialize_compact(buff, codec);
+        }
+        break;
+      }
+      buff.write16(turn)
+          .write32((uint32_t) events.size());
+      for (const Event &event : events)
+        event.serialize(buff);
+      break;
+    case ServerToClientType::GameEnded:
+      codec.write_length(buff, scores.size());
+      for (const auto &[id, score] : scores) {
+        buff.write8(id);
+        if (codec.version == ProtocolVersion::Compact)
+          buff.write_varint(score);
+        else
+          buff.write32(score);
+      }
+      break;
+    case ServerToClientType::ProtocolAccepted:
+      buff.write8(static_cast<uint8_t>(version));
+      codec.version = version;
+      break;
+    case ServerToClientType::Session:
+      buff.write64(token);
+      break;
+    case ServerToClientType::StateHash:
+      StateHashLayout::write(buff, *this);
+      break;
+    case ServerToClientType::Snapshot:
+      buff.write16(turn);
+      codec.write_length(buff, player_positions.size());
+      for (const auto &[id, position] : player_positions) {
+        buff.write8(id);
+        position.serialize(buff);
+      }
+      codec.write_length(buff, blocks.size());
+      write_positions(buff, blocks);
+      codec.write_length(buff, bombs.size());
+      for (const auto &bomb : bombs)
+        BombLayout::write(buff, bomb);
+      codec.write_length(buff, explosions.size());
+      write_positions(buff, explosions);
+      codec.write_length(buff, scores.size());
+      for (const auto &[id, score] : scores) {
+        buff.write8(id)
+            .write32(score);
+      }
+      break;
+  }
+}
+
+GUIToClient::GUIToClient(Connection &conn) {
+  uint8_t u8;
+  conn.read8(u8);
+  if (u8 > static_cast<uint8_t>(GUIToClientType::MAX))
+    throw GUIReadError();
+  type = GUIToClientType(u8);
+  switch (type) {
+    case GUIToClientType::Move:
+      conn.read8(u8);
+      if (u8 > static_cast<uint8_t>(Direction::MAX))
+        throw ServerReadError();
+      direction = Direction(u8);
+      break;
+    default:
+      break;
+  }
+}
+
+Bomb* ClientToGUI::find_bomb(Bomb::BombId id) {
+  auto it = lower_bound_bomb(bombs, id);
+  if (it == bombs.end() || it->first != id)
+    return nullptr;
+  return &it->second;
+}
+
+void ClientToGUI::clear_board() {
+  player_positions.fill(std::nullopt);
+  scores.fill(0);
+  blocks.clear();
+  bombs.clear();
+  explosions.clear();
+  pieces_hash = 0;
+  // No turn was applied yet, a resumed session starts from 0.
+  turn = UINT16_MAX;
+}
+
+void ClientToGUI::reserve(const ParseLimits &limits) {
+  // A robot places at most one bomb a turn, so at most one of its bombs
+  // explodes in a turn. Explosions of merged turns add up, but they are
+  // distinct cells after every turn.
+  uint64_t explosion_cells = 1 + BlockBoard::RAYS * explosion_radius;
+  bombs.reserve(std::min(limits.bombs, MAX_RESERVED_STATE));
+  explosions.reserve(std::min(
+    limits.cells + limits.players * explosion_cells, MAX_RESERVED_STATE
+  ));
+  blocks_destroyed.reserve(std::min(
+    limits.players * BLOCKS_PER_EXPLOSION, MAX_RESERVED_STATE
+  ));
+}
+
+void ClientToGUI::place_bomb(Bomb::BombId id, const Bomb &bomb) {
+  pieces_hash ^= zobrist::bomb(id, bomb.position.x, bomb.position.y);
+  if (bombs.empty() || bombs.back().first < id) {
+    bombs.emplace_back(id, bomb);
+    return;
+  }
+  auto it = lower_bound_bomb(bombs, id);
+  if (it != bombs.end() && it->first == id) {
+    const Position &old = it->second.position;
+    pieces_hash ^= zobrist::bomb(id, old.x, old.y);
+    it->second = bomb;
+  }
+  else
+    bombs.emplace(it, id, bomb);
+}
+
+void ClientToGUI::remove_bomb(Bomb::BombId id) {
+  auto it = lower_bound_bomb(bombs, id);
+  if (it != bombs.end() && it->first == id) {
+    const Position &position = it->second.position;
+    pieces_hash ^= zobrist::bomb(id, position.x, position.y);
+    bombs.erase(it);
+  }
+}
+
+void ClientToGUI::move_robot(Player::PlayerId id, const Position &position) {
+  if (const std::optional<Position> &old = player_positions[id])
+    pieces_hash ^= zobrist::robot(id, old->x, old->y);
+  pieces_hash ^= zobrist::robot(id, position.x, position.y);
+  player_positions[id] = position;
+}
+
+void ClientToGUI::add_score(Player::PlayerId id, Player::Score points) {
+  pieces_hash ^= zobrist::score(id, scores[id]);
+  scores[id] += points;
+  pieces_hash ^= zobrist::score(id, scores[id]);
+}
+
+uint64_t ClientToGUI::state_hash() const {
+  return blocks.hash() ^ pieces_hash;
+}
+
+void ClientToGUI::apply_turn(
+  uint16_t turn,
+  const std::vector<Event> &events
+  ) {
+  robots_destroyed.reset();
+  blocks_destroyed.clear();
+  this->turn = turn;
+
+  // Decrease bomb timers
+  for (auto &[id, bomb] : bombs)
+    bomb.timer--;
+
+  for (const Event &event : events) {
+    switch (event.type) {
+      case EventType::BombPlaced:
+        place_bomb(
+          event.bomb_id,
+          Bomb(event.position, event.timer != 0 ? event.timer : bomb_timer)
+        );
+        break;
+      case EventType::BombExploded:
+        // Servers filtering events by distance may report explosions
+        // of bombs this client has never seen.
+        if (const Bomb *bomb = find_bomb(event.bomb_id)) {
+          const Position &centre = bomb->position;
+          BlockBoard::Reach reach = blocks.explosion(centre, explosion_radius);
+          explosions.push_back(centre);
+          for (size_t ray = 0; ray < BlockBoard::RAYS; ray++) {
+            for (uint16_t i = 1; i <= reach[ray]; i++)
+              explosions.push_back(BlockBoard::cell(centre, ray, i));
+          }
+        }
+        blocks_destroyed.insert(
+          blocks_destroyed.end(),
+          event.blocks_destroyed.begin(),
+          event.blocks_destroyed.end()
+        );
+        for (const Player::PlayerId &id : event.robots_destroyed)
+          robots_destroyed.set(id);
+        remove_bomb(event.bomb_id);
+        break;
+      case EventType::PlayerMoved:
+        move_robot(event.player_id, event.position);
+        break;
+      case EventType::BlockPlaced:
+        blocks.insert(event.position);
+    }
+  }
+
+  // Calculate the scores for this turn and erase destroyed blocks.
+  for (const Position &position : blocks_destroyed)
+    blocks.erase(position);
+  for (size_t id = 0; id < robots_destroyed.size(); id++) {
+    if (robots_destroyed[id])
+      add_score((Player::PlayerId) id, 1);
+  }
+  std::sort(explosions.begin(), explosions.end());
+  explosions.erase(
+    std::unique(explosions.begin(), explosions.end()),
+    explosions.end()
+  );
+}
+
+void ClientToGUI::apply_snapshot(const ServerToClient &in) {
+  clear_board();
+  turn = in.turn;
+  for (const auto &[id, position] : in.player_positions)
+    move_robot(id, position);
+  for (const Position &position : in.blocks)
+    blocks.insert(position);
+  for (const auto &[id, bomb] : in.bombs)
+    place_bomb(id, bomb);
+  explosions = in.explosions;
+  std::sort(explosions.begin(), explosions.end());
+  explosions.erase(
+    std::unique(explosions.begin(), explosions.end()),
+    explosions.end()
+  );
+  for (const auto &[id, score] : in.scores)
+    add_score(id, score);
+}
+
+void ClientToGUI::serialize(Buffer &buff) const {
+  uint32_t present_players = 0;
+  for (const std::optional<Player> &player : players)
+    present_players += player.has_value();
+  buff.write8(static_cast<uint8_t>(type))
+      .write_string(server_name);
+  switch (type) {
+    case ClientToGUIType::Lobby:
+      LobbyLayout::write(buff, *this);
+      buff.write32(present_players);
+      for (size_t id = 0; id < players.size(); id++) {
+        if (players[id]) {
+          buff.write8((uint8_t) id);
+          players[id]->serialize(buff);
+        }
+      }
+      break;
+    case ClientToGUIType::Game:
+      {
+      GameLayout::write(buff, *this);
+      buff.write32(present_players);
+      for (size_t id = 0; id < players.size(); id++) {
+        if (players[id]) {
+          buff.write8((uint8_t) id);
+          players[id]->serialize(buff);
+        }
+      }
+      uint32_t position_count = 0;
+      for (const std::optional<Position> &position : player_positions)
+        position_count += position.has_value();
+      buff.write32(position_count);
+      for (size_t id = 0; id < player_positions.size(); id++) {
+        if (player_positions[id]) {
+          buff.write8((uint8_t) id);
+          player_positions[id]->serialize(buff);
+        }
+      }
+      // Blocks are laid out in host order first and then converted
+      // all at once.
+      buff.write32((uint32_t) blocks.size());
+      size_t offset = buff.data.size();
+      buff.data.resize(offset + blocks.size() * sizeof(Position));
+      uint8_t *out = buff.data.data() + offset;
+      blocks.for_each([&](uint16_t x, uint16_t y) {
+        Position position(x, y);
+        memcpy(out, &position, sizeof(position));
+        out += sizeof(position);
+      });
+      swap16_array(buff.data.data() + offset, 2 * blocks.size());
+      buff.write32((uint32_t) bombs.size());
+      for (const auto &[id, bomb] : bombs)
+        bomb.serialize(buff);
+      buff.write32((uint32_t) explosions.size());
+      write_positions(buff, explosions);
+      buff.write32(present_players);
+      for (size_t id = 0; id < players.size(); id++) {
+        if (players[id]) {
+          buff.write8((uint8_t) id)
+              .write32(scores[id]);
+        }
+      }
+      }
+  }
+}
@@ -1,153 +1,276 @@
-#ifndef MESSAGES_HPP
-#define MESSAGES_HPP
-#include <string>
-#include <vector>
-#include <exception>
-#include <map>
-#include <set>
-#include "connections.hpp"
-
-// This file includes declarations for structures used for
-// serializing and deserializing messages.
-
-class GUIReadError : public std::exception {};
-
-class ClientReadError : public std::exception {};
-
-class ServerReadError : public std::exception {
-public:
-  const char * what () const throw () {
-    return "Unable to parse message from server";
-  }
-};
-
-enum struct Direction : uint8_t {
-  Up = 0, Right = 1, Down = 2, Left = 3, MAX = 3
-};
-
-struct Position {
-  uint16_t x, y;
-  bool operator<(const Position&) const;
-
-  Position() = default;
-  Position(uint16_t, uint16_t);
-  Position(Connection&);
-  void serialize(Buffer&) const;
-};
-
-struct Player {
-  using PlayerId = uint8_t;
-  using Score = uint32_t;
-  std::string name, address;
-
-  Player() = default;
-  Player(std::string, std::string);
-  Player(Connection&);
-  void serialize(Buffer&) const;
-};
-
-struct Bomb {
-  using BombId = uint32_t;
-  Position position;
-  uint16_t timer;
-
-  Bomb() = default;
-  Bomb(Position, uint16_t);
-  void serialize(Buffer&) const;
-};
-
-enum struct ClientToServerType : uint8_t {
-  Join = 0, PlaceBomb = 1, PlaceBlock = 2, Move = 3, MAX = 3
-};
-
-// Struct holding data for messages to the server.
-struct ClientToServer {
-  ClientToServerType type;
-  std::string name;
-  Direction direction;
-
-  ClientToServer() = default;
-  ClientToServer(Connection&);
-  void serialize(Buffer&) const;
-};
-
-enum struct EventType : uint8_t {
-  BombPlaced = 0, BombExploded = 1, PlayerMoved = 2, 
-  BlockPlaced = 3, MAX = 3
-};
-
-struct Event {
-  EventType type;
-  Bomb::BombId bomb_id;
-  Player::PlayerId player_id;
-  Position position;
-  std::vector<Player::PlayerId> robots_destroyed;
-  std::vector<Position> blocks_destroyed;
-
-  Event() = default;
-  Event(Connection&);
-  void serialize(Buffer&) const;
-};
-
-enum struct ServerToClientType : uint8_t {
-  Hello = 0, AcceptedPlayer = 1, GameStarted = 2, 
-  Turn = 3, GameEnded = 4, MAX = 4
-};
-
-// Struct holding data for messages from the server.
-struct ServerToClient {
-  ServerToClientType type;
-  std::string server_name;
-  uint8_t player_count;
-  uint16_t size_x, size_y;
-  uint16_t game_length;
-  uint16_t explosion_radius, bomb_timer;
-  Player::PlayerId player_id;
-  Player player;
-  std::map<Player::PlayerId, Player> players;
-  uint16_t turn;
-  std::vector<Event> events;
-  std::map<Player::PlayerId, Player::Score> scores;
-
-  ServerToClient() = default;
-  ServerToClient(Connection&);
-  void serialize(Buffer&) const;
-};
-
-enum struct GUIToClientType : uint8_t {
-  PlaceBomb = 0, PlaceBlock = 1, Move = 2, MAX = 2
-};
-
-// Struct holding data for messages from GUI.
-struct GUIToClient {
-  GUIToClientType type;
-  Direction direction;
-
-  GUIToClient(Connection&);
-};
-
-enum struct ClientToGUIType : uint8_t {
-  Lobby = 0, Game = 1, MAX = 1
-};
-
-// Struct holding data for messages to GUI.
-struct ClientToGUI {
-  ClientToGUIType type;
-  std::string server_name;
-  uint8_t player_count;
-  uint16_t size_x, size_y;
-  uint16_t game_length;
-  uint16_t explosion_radius, bomb_timer;
-  std::map<Player::PlayerId, Player> players;
-  uint16_t turn;
-  std::map<Player::PlayerId, Position> player_positions;
-  std::set<Position> blocks;
-  std::map<Bomb::BombId, Bomb> bombs;
-  std::set<Position> explosions;
-  std::map<Player::PlayerId, Player::Score> scores;
-
-  ClientToGUI() = default;
-  void serialize(Buffer&) const;
-};
-
+#ifndef MESSAGES_HPP
+#define MESSAGES_HPP
+#include <string>
+#include <vector>
+#include <exception>
+#include <map>
+#include <set>
+#include <array>
+#include <optional>
+#include <bitset>
+#include "connections.hpp"
+#include "board.hpp"
+
+// This file includes declarations for structures used for
+// serializing and deserializing messages.
+
+class GUIReadError : public std::exception {};
+
+class ClientReadError : public std::exception {};
+
+class ServerReadError : public std::exception {
+public:
+  const char * what () const throw () {
+    return "Unable to parse message from server";
+  }
+};
+
+// Wire protocol versions. Classic is the fixed-width format every peer
+// understands, Compact uses varints, delta-encoded positions and runs of
+// events of the same type. A client asks for Compact after Hello and the
+// server switches with a ProtocolAccepted message before GameStarted.
+enum struct ProtocolVersion : uint8_t {
+  Classic = 1, Compact = 2, MAX = 2
+};
+
+enum struct Direction : uint8_t {
+  Up = 0, Right = 1, Down = 2, Left = 3, MAX = 3
+};
+
+struct Position {
+  uint16_t x, y;
+  bool operator<(const Position&) const;
+  bool operator==(const Position&) const = default;
+
+  Position() = default;
+  Position(uint16_t, uint16_t);
+  Position(Connection&);
+  void serialize(Buffer&) const;
+};
+
+struct Player {
+  using PlayerId = uint8_t;
+  using Score = uint32_t;
+  std::string name, address;
+
+  Player() = default;
+  Player(std::string, std::string);
+  Player(Connection&);
+  void serialize(Buffer&) const;
+};
+
+struct Bomb {
+  using BombId = uint32_t;
+  Position position;
+  uint16_t timer;
+
+  Bomb() = default;
+  Bomb(Position, uint16_t);
+  void serialize(Buffer&) const;
+};
+
+// Bounds on what a server may send, derived from its Hello. Counts
+// read from the stream are checked against them before anything is
+// reserved and every message gets a byte budget, so a broken server
+// can make the client neither allocate nor parse without end. Until
+// the Hello arrives nothing but the Hello fits.
+struct ParseLimits {
+  // The board is kept as bitboards, a Hello announcing a bigger one
+  // is refused instead of taking up to a gigabyte.
+  static constexpr uint64_t MAX_CELLS = uint64_t(1) << 26;
+
+  uint16_t size_x{0}, size_y{0}, bomb_timer{0};
+  uint64_t players{0}, cells{0}, bombs{0}, events{0};
+
+  ParseLimits() = default;
+  ParseLimits(
+    uint8_t player_count,
+    uint16_t size_x,
+    uint16_t size_y,
+    uint16_t bomb_timer
+  );
+
+  // Throws if the position is not on the board.
+  const Position &check(const Position&) const;
+};
+
+// Per-connection encoding state shared by both ends of a stream.
+// In the Compact protocol positions are sent as differences from the
+// previously sent position (or from the player's previous position
+// for PlayerMoved) and bomb ids as differences from the last bomb id.
+// Bombs with a timer of their own come in runs of a type past the
+// event types, each followed by its timer.
+struct Codec {
+  ProtocolVersion version{ProtocolVersion::Classic};
+  Position cursor{0, 0};
+  Bomb::BombId last_bomb{0};
+  std::array<Position, 256> players{};
+  // Only used by the receiving end, kept across games.
+  ParseLimits limits;
+
+  // Clears the delta state, done by both sides on every GameStarted.
+  void reset();
+
+  void write_position(Buffer&, Position&, const Position&);
+  Position read_position(Connection&, Position&);
+  void write_bomb_id(Buffer&, Bomb::BombId);
+  Bomb::BombId read_bomb_id(Connection&);
+  void write_length(Buffer&, size_t) const;
+  uint32_t read_length(Connection&) const;
+};
+
+enum struct ClientToServerType : uint8_t {
+  Join = 0, PlaceBomb = 1, PlaceBlock = 2, Move = 3, 
+  Negotiate = 4, Resume = 5, VerifyState = 6, MAX = 6
+};
+
+// Struct holding data for messages to the server.
+struct ClientToServer {
+  ClientToServerType type;
+  std::string name;
+  Direction direction;
+  ProtocolVersion version;
+  // Resume asks for a new session with a zero token, otherwise it
+  // continues the session from `turn`, the first turn not yet seen.
+  uint64_t token;
+  uint16_t turn;
+
+  ClientToServer() = default;
+  // The type byte is read by the caller, so that it can tell a message
+  // in progress from a connection waiting for the next one.
+  ClientToServer(Connection&, uint8_t type);
+  void serialize(Buffer&) const;
+};
+
+enum struct EventType : uint8_t {
+  BombPlaced = 0, BombExploded = 1, PlayerMoved = 2, 
+  BlockPlaced = 3, MAX = 3
+};
+
+struct Event {
+  EventType type;
+  Bomb::BombId bomb_id;
+  Player::PlayerId player_id;
+  Position position;
+  // Turns left until a placed bomb explodes, if it was placed in an
+  // earlier turn: filtered streams announce bombs coming into view this
+  // way. Zero for a bomb placed in this turn, whose timer is full. Only
+  // the Compact protocol carries it.
+  uint16_t timer{0};
+  std::vector<Player::PlayerId> robots_destroyed;
+  std::vector<Position> blocks_destroyed;
+
+  Event() = default;
+  Event(Connection&, const ParseLimits&);
+  void serialize(Buffer&) const;
+
+  // Compact protocol: the type is sent once per run of events,
+  // so these only handle the remaining fields.
+  Event(Connection&, EventType, Codec&);
+  void serialize_compact(Buffer&, Codec&) const;
+};
+
+enum struct ServerToClientType : uint8_t {
+  Hello = 0, AcceptedPlayer = 1, GameStarted = 2, 
+  Turn = 3, GameEnded = 4, ProtocolAccepted = 5, Session = 6,
+  Snapshot = 7, StateHash = 8, MAX = 8
+};
+
+// Struct holding data for messages from the server.
+struct ServerToClient {
+  ServerToClientType type;
+  std::string server_name;
+  uint8_t player_count;
+  uint16_t size_x, size_y;
+  uint16_t game_length;
+  uint16_t explosion_radius, bomb_timer;
+  Player::PlayerId player_id;
+  Player player;
+  std::map<Player::PlayerId, Player> players;
+  uint16_t turn;
+  std::vector<Event> events;
+  std::map<Player::PlayerId, Player::Score> scores;
+  ProtocolVersion version;
+  uint64_t token;
+  // The board at the end of `turn`, sent instead of the turns
+  // a resumed session missed.
+  std::map<Player::PlayerId, Position> player_positions;
+  std::vector<Position> blocks;
+  std::vector<std::pair<Bomb::BombId, Bomb>> bombs;
+  std::vector<Position> explosions;
+  // Zobrist hash of the state at the end of `turn`, sent after the
+  // turn to clients that asked to verify their state.
+  uint64_t state_hash;
+
+  ServerToClient() = default;
+  // Messages follow the protocol negotiated on the connection
+  // and update its codec state.
+  ServerToClient(Connection&, Codec&);
+  void serialize(Buffer&, Codec&) const;
+};
+
+enum struct GUIToClientType : uint8_t {
+  PlaceBomb = 0, PlaceBlock = 1, Move = 2, MAX = 2
+};
+
+// Struct holding data for messages from GUI.
+struct GUIToClient {
+  GUIToClientType type;
+  Direction direction;
+
+  GUIToClient(Connection&);
+};
+
+enum struct ClientToGUIType : uint8_t {
+  Lobby = 0, Game = 1, MAX = 1
+};
+
+// Struct holding data for messages to GUI. The game state is kept in
+// flat containers that are reused from turn to turn and serialize in
+// the order of the protocol's maps and sets.
+struct ClientToGUI {
+  ClientToGUIType type;
+  std::string server_name;
+  uint8_t player_count;
+  uint16_t size_x, size_y;
+  uint16_t game_length;
+  uint16_t explosion_radius, bomb_timer;
+  uint16_t turn;
+  // Indexed by player id, scores only matter for present players.
+  std::array<std::optional<Player>, 256> players;
+  std::array<std::optional<Position>, 256> player_positions;
+  std::array<Player::Score, 256> scores;
+  BlockBoard blocks;
+  // Bombs ordered by id. Ids of new bombs grow, so they are appended.
+  std::vector<std::pair<Bomb::BombId, Bomb>> bombs;
+  // Has to be sorted and without duplicates when serialized.
+  std::vector<Position> explosions;
+  // Scratch space of apply_turn, reused between turns.
+  std::bitset<256> robots_destroyed;
+  std::vector<Position> blocks_destroyed;
+  // Zobrist hash of robots, bombs and scores, blocks hash themselves.
+  uint64_t pieces_hash{0};
+
+  ClientToGUI() = default;
+  // Removes everything from the board, for a new game.
+  void clear_board();
+  // Makes room for the bombs and explosions of a game within `limits`,
+  // so that its turns do not grow the lists.
+  void reserve(const ParseLimits&);
+  // Applies the events of one turn. Its explosions are added to the
+  // ones already there, clearing them is up to the caller.
+  void apply_turn(uint16_t turn, const std::vector<Event>&);
+  // Replaces the board with the one of a Snapshot message.
+  void apply_snapshot(const ServerToClient&);
+  Bomb* find_bomb(Bomb::BombId);
+  void place_bomb(Bomb::BombId, const Bomb&);
+  void remove_bomb(Bomb::BombId);
+  void move_robot(Player::PlayerId, const Position&);
+  void add_score(Player::PlayerId, Player::Score);
+  // Zobrist hash of the state, the same as the server's for the same
+  // board.
+  uint64_t state_hash() const;
+  void serialize(Buffer&) const;
+};
+
 #endif // MESSAGES_HPP
\ No newline at end of file
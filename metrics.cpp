@@ -0,0 +1,81 @@
+#include <string>
+#include <bit>
+#include "metrics.hpp"
+
+namespace {
+  // Appends `name` followed by the labels, if any.
+  void series(
+    std::string &out,
+    const char *name,
+    const char *suffix,
+    const std::string &labels
+    ) {
+    out += name;
+    out += suffix;
+    if (!labels.empty())
+      out += "{" + labels + "}";
+  }
+} // anonymous namespace
+
+void dump_type(std::string &out, const char *name, const char *type) {
+  out += "# TYPE ";
+  out += name;
+  out += " ";
+  out += type;
+  out += "\n";
+}
+
+void Counter::dump(std::string &out, const char *name) const {
+  dump_type(out, name, "counter");
+  dump_series(out, name, "");
+}
+
+void Counter::dump_series(
+  std::string &out,
+  const char *name,
+  const std::string &labels
+  ) const {
+  series(out, name, "", labels);
+  out += " " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+}
+
+void Histogram::record(uint64_t value) {
+  size_t bucket = std::bit_width(value);
+  if (bucket >= BUCKETS)
+    bucket = BUCKETS - 1;
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Histogram::dump(std::string &out, const char *name) const {
+  dump_type(out, name, "histogram");
+  dump_series(out, name, "");
+}
+
+void Histogram::dump_series(
+  std::string &out,
+  const char *name,
+  const std::string &labels
+  ) const {
+  std::string prefix = labels.empty() ? "" : labels + ",";
+  // Buckets are reported cumulatively, with inclusive upper bounds.
+  uint64_t cumulative = 0;
+  size_t last = BUCKETS;
+  while (last > 1 && buckets[last - 1].load(std::memory_order_relaxed) == 0)
+    last--;
+  for (size_t i = 0; i < last; i++) {
+    cumulative += buckets[i].load(std::memory_order_relaxed);
+    uint64_t bound = (i == 0) ? 0 : (uint64_t(1) << i) - 1;
+    out += name;
+    out += "_bucket{" + prefix + "le=\"" + std::to_string(bound) + "\"} ";
+    out += std::to_string(cumulative) + "\n";
+  }
+  out += name;
+  out += "_bucket{" + prefix + "le=\"+Inf\"} ";
+  out += std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+  series(out, name, "_sum", labels);
+  out += " " + std::to_string(sum.load(std::memory_order_relaxed)) + "\n";
+  series(out, name, "_count", labels);
+  out += " " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+}
@@ -0,0 +1,76 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+#include <string>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Lock-free metrics for hot paths. Updates are single relaxed atomic
+// operations, reading them is only done when the metrics are dumped.
+// Dumps use the plain-text Prometheus exposition format. Metrics with
+// several series dump the type once and then each series with its
+// labels, given like `site="a"`.
+
+void dump_type(std::string&, const char *name, const char *type);
+
+// Monotonically increasing counter.
+class Counter {
+public:
+  void add(uint64_t value = 1) {
+    count.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const {
+    return count.load(std::memory_order_relaxed);
+  }
+
+  void dump(std::string&, const char *name) const;
+  void dump_series(
+    std::string&,
+    const char *name,
+    const std::string &labels
+    ) const;
+
+private:
+  std::atomic<uint64_t> count{0};
+};
+
+// Histogram with power-of-two buckets: bucket `i` counts values
+// in [2^(i-1), 2^i), bucket 0 counts zeros.
+class Histogram {
+public:
+  void record(uint64_t value);
+
+  void dump(std::string&, const char *name) const;
+  void dump_series(
+    std::string&,
+    const char *name,
+    const std::string &labels
+    ) const;
+
+private:
+  static constexpr size_t BUCKETS = 40;
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+  std::atomic<uint64_t> count{0}, sum{0};
+};
+
+// Records the lifetime of the timer in a histogram, in microseconds.
+class ScopedTimer {
+public:
+  ScopedTimer(Histogram &histogram)
+  : histogram(histogram),
+    start(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() {
+    histogram.record((uint64_t) std::chrono::duration_cast<
+      std::chrono::microseconds
+    >(std::chrono::steady_clock::now() - start).count());
+  }
+
+private:
+  Histogram &histogram;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif // METRICS_HPP
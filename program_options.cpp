@@ -1,110 +1,183 @@
-#include <boost/program_options.hpp>
-#include <boost/optional.hpp>
-#include <string>
-#include <iostream>
-#include <exception>
-#include <cstdint>
-#include <chrono>
-#include "program_options.hpp"
-
-// Function retrieves the port from a valid address.
-bool resolve_address(
-  std::string &full_address, 
-  std::string *address, 
-  std::string *port
-  ) {
-  std::string::size_type last_colon;
-  last_colon = full_address.rfind(":");
-  if (last_colon == std::string::npos)
-    return false;
-  *address = full_address.substr(0, last_colon);
-  *port = full_address.substr(last_colon + 1);
-  return true;
-}
-
-// Function checks if the provided value of an options is valid.
-template<typename T>
-void bound_check(
-  int64_t value,
-  T &option,
-  const std::string &name,
-  bool non_zero = true
-  ) {
-  if (value < (int64_t) non_zero || value > std::numeric_limits<T>::max())
-    throw OptionsError("Please provide a valid " + name + " value");
-  option = (T) value;  
-}
-
-ClientOptions::ClientOptions(int argc, char* argv[]) {
-  namespace po = boost::program_options;
-  po::options_description desc("Allowed options");
-  std::string gui_address_, server_address_;
-  int64_t port_;
-  desc.add_options()
-    ("gui-address,d", po::value<std::string>(&gui_address_)->required(), "gui address")
-    ("help,h", "produce help message")
-    ("player-name,n", po::value<std::string>(&player_name)->required(), "player name")
-    ("port,p", po::value<int64_t>(&port_)->required(), "port")
-    ("server-address,s", po::value<std::string>(&server_address_)->required(), "server address")
-    ;
-  po::variables_map vm;
-  po::store(po::parse_command_line(argc, argv, desc), vm);
-
-  if (vm.count("help")) {
-    // Print the help message.
-    std::cout << desc << "\n";
-    exit(EXIT_SUCCESS);
-  }
-  po::notify(vm);
-
-  if (!resolve_address(gui_address_, &gui_address, &gui_port))
-    throw OptionsError("Please provide a valid gui address");
-  if (!resolve_address(server_address_, &server_address, &server_port))
-    throw OptionsError("Please provide a valid server address");
-  bound_check(port_, port, "port");
-}
-
-ServerOptions::ServerOptions(int argc, char* argv[]) {
-  namespace po = boost::program_options;
-  po::options_description desc("Allowed options");
-  int64_t bomb_timer_, players_count_, explosion_radius_,
-          initial_blocks_, game_length_,
-          port_, seed_, size_x_, size_y_;
-  seed = static_cast<uint32_t>(
-    std::chrono::system_clock::now().time_since_epoch().count()
-  );  
-        
-  desc.add_options()
-    ("bomb-timer,b", po::value<int64_t>(&bomb_timer_)->required(), "bomb timer")
-    ("players-count,c", po::value<int64_t>(&players_count_)->required(), "players count")
-    ("turn-duration,d", po::value<uint64_t>(&turn_duration)->required(), "turn duration")
-    ("explosion-radius,e", po::value<int64_t>(&explosion_radius_)->required(), "explosion radius")
-    ("help,h", "produce help message")
-    ("initial-blocks,k", po::value<int64_t>(&initial_blocks_)->required(), "initial blocks")
-    ("game-length,l", po::value<int64_t>(&game_length_)->required(), "game length")
-    ("server-name,n", po::value<std::string>(&server_name)->required(), "server name")
-    ("port,p", po::value<int64_t>(&port_)->required(), "port")
-    ("seed,s", po::value<int64_t>(&seed_)->default_value(seed), "seed")
-    ("size-x,x", po::value<int64_t>(&size_x_), "size x")
-    ("size-y,y", po::value<int64_t>(&size_y_), "size y")
-    ;
-  po::variables_map vm;
-  po::store(po::parse_command_line(argc, argv, desc), vm);
-
-  if (vm.count("help")) {
-    // Print the help message.
-    std::cout << desc << "\n";
-    exit(EXIT_SUCCESS);
-  }
-  po::notify(vm);
-
-  bound_check(bomb_timer_, bomb_timer, "bomb timer");
-  bound_check(players_count_, players_count, "players count");
-  bound_check(explosion_radius_, explosion_radius, "explosion radius", false);
-  bound_check(initial_blocks_, initial_blocks, "initial blocks", false);
-  bound_check(game_length_, game_length, "game length");
-  bound_check(port_, port, "port");
-  bound_check(seed_, seed, "seed", false);
-  bound_check(size_x_, size_x, "size x");
-  bound_check(size_y_, size_y, "size y");
+#include <boost/program_options.hpp>
+#include <boost/optional.hpp>
+#include <string>
+#include <iostream>
+#include <exception>
+#include <cstdint>
+#include <chrono>
+#include "program_options.hpp"
+
+// Prefix of gui addresses naming a local socket.
+const std::string UNIX_PREFIX = "unix:";
+
+// Function retrieves the port from a valid address.
+bool resolve_address(
+  std::string &full_address, 
+  std::string *address, 
+  std::string *port
+  ) {
+  std::string::size_type last_colon;
+  last_colon = full_address.rfind(":");
+  if (last_colon == std::string::npos)
+    return false;
+  *address = full_address.substr(0, last_colon);
+  *port = full_address.substr(last_colon + 1);
+  return true;
+}
+
+// Function checks if the provided value of an options is valid.
+template<typename T>
+void bound_check(
+  int64_t value,
+  T &option,
+  const std::string &name,
+  bool non_zero = true
+  ) {
+  if (value < (int64_t) non_zero || value > std::numeric_limits<T>::max())
+    throw OptionsError("Please provide a valid " + name + " value");
+  option = (T) value;  
+}
+
+// Function translates the name of a log level.
+LogLevel parse_log_level(const std::string &name) {
+  if (name == "debug")
+    return LogLevel::Debug;
+  if (name == "info")
+    return LogLevel::Info;
+  if (name == "error")
+    return LogLevel::Error;
+  if (name == "off")
+    return LogLevel::Off;
+  throw OptionsError("Please provide a valid log level value");
+}
+
+// Function translates the name of an io backend.
+IoBackend parse_io_backend(const std::string &name) {
+  if (name == "asio")
+    return IoBackend::Asio;
+  if (name == "uring")
+    return IoBackend::Uring;
+  throw OptionsError("Please provide a valid io backend value");
+}
+
+ClientOptions::ClientOptions(int argc, char* argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  std::string gui_address_, server_address_, log_level_, io_backend_;
+  int64_t port_ = 0, protocol_version_, max_gui_rate_, reconnect_attempts_;
+  desc.add_options()
+    ("gui-address,d", po::value<std::string>(&gui_address_)->required(), "gui address, or unix:path for a gui on a local socket (the client listens on path.client)")
+    ("help,h", "produce help message")
+    ("io-backend", po::value<std::string>(&io_backend_)->default_value("asio"), "socket io backend (asio, uring - io_uring, falls back to asio if unavailable)")
+    ("log-level", po::value<std::string>(&log_level_)->default_value("debug"), "log level (debug, info, error, off)")
+    ("max-gui-rate", po::value<int64_t>(&max_gui_rate_)->default_value(0), "max states sent to the gui per second, 0 sends every state")
+    ("player-name,n", po::value<std::string>(&player_name)->required(), "player name")
+    ("reconnect", po::value<int64_t>(&reconnect_attempts_)->default_value(0), "attempts to reconnect and resume the game after losing the server, 0 exits at once")
+    ("port,p", po::value<int64_t>(&port_), "port, not needed for a gui on a local socket")
+    ("server-address,s", po::value<std::string>(&server_address_)->required(), "server address")
+    ("protocol-version,v", po::value<int64_t>(&protocol_version_)->default_value(1), "protocol version (1 - classic, 2 - compact)")
+    ("verify-state", po::bool_switch(&verify_state), "check the board against the server's state hashes, resuming from a snapshot on a mismatch if reconnecting is enabled")
+    ;
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+
+  if (vm.count("help")) {
+    // Print the help message.
+    std::cout << desc << "\n";
+    exit(EXIT_SUCCESS);
+  }
+  po::notify(vm);
+
+  if (gui_address_.starts_with(UNIX_PREFIX)) {
+    gui_socket = gui_address_.substr(UNIX_PREFIX.size());
+    if (gui_socket.empty())
+      throw OptionsError("Please provide a valid gui address");
+  }
+  else if (!resolve_address(gui_address_, &gui_address, &gui_port))
+    throw OptionsError("Please provide a valid gui address");
+  if (!resolve_address(server_address_, &server_address, &server_port))
+    throw OptionsError("Please provide a valid server address");
+  bound_check(port_, port, "port", gui_socket.empty());
+  bound_check(max_gui_rate_, max_gui_rate, "max gui rate", false);
+  bound_check(reconnect_attempts_, reconnect_attempts, "reconnect attempts", false);
+  if (protocol_version_ < 1 || 
+      protocol_version_ > static_cast<int64_t>(ProtocolVersion::MAX))
+    throw OptionsError("Please provide a valid protocol version value");
+  protocol_version = ProtocolVersion(protocol_version_);
+  log_level = parse_log_level(log_level_);
+  io_backend = parse_io_backend(io_backend_);
+}
+
+ServerOptions::ServerOptions(int argc, char* argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  int64_t bomb_timer_, players_count_, explosion_radius_,
+          initial_blocks_, game_length_,
+          port_, seed_, size_x_, size_y_, max_write_batch_,
+          stats_port_, interest_radius_, explosion_threads_, acceptors_,
+          max_connections_, idle_timeout_, max_input_rate_;
+  std::string log_level_, io_backend_;
+  seed = static_cast<uint32_t>(
+    std::chrono::system_clock::now().time_since_epoch().count()
+  );  
+        
+  desc.add_options()
+    ("bomb-timer,b", po::value<int64_t>(&bomb_timer_)->required(), "bomb timer")
+    ("players-count,c", po::value<int64_t>(&players_count_)->required(), "players count")
+    ("turn-duration,d", po::value<uint64_t>(&turn_duration)->required(), "turn duration")
+    ("explosion-radius,e", po::value<int64_t>(&explosion_radius_)->required(), "explosion radius")
+    ("help,h", "produce help message")
+    ("io-backend", po::value<std::string>(&io_backend_)->default_value("asio"), "socket io backend (asio, uring - io_uring, falls back to asio if unavailable)")
+    ("log-level", po::value<std::string>(&log_level_)->default_value("debug"), "log level (debug, info, error, off)")
+    ("initial-blocks,k", po::value<int64_t>(&initial_blocks_)->required(), "initial blocks")
+    ("game-length,l", po::value<int64_t>(&game_length_)->required(), "game length")
+    ("server-name,n", po::value<std::string>(&server_name)->required(), "server name")
+    ("port,p", po::value<int64_t>(&port_)->required(), "port")
+    ("seed,s", po::value<int64_t>(&seed_)->default_value(seed), "seed")
+    ("size-x,x", po::value<int64_t>(&size_x_), "size x")
+    ("size-y,y", po::value<int64_t>(&size_y_), "size y")
+    ("interest-radius", po::value<int64_t>(&interest_radius_)->default_value(0), "send players only events within this distance of their robot, 0 sends everything")
+    ("stats-port", po::value<int64_t>(&stats_port_)->default_value(0), "local port serving metrics, 0 disables it")
+    ("max-write-batch", po::value<int64_t>(&max_write_batch_)->default_value(64), "max turns coalesced into one write to a lagging client")
+    ("explosion-threads", po::value<int64_t>(&explosion_threads_)->default_value(1), "threads computing explosions of turns with many bombs")
+    ("acceptors", po::value<int64_t>(&acceptors_)->default_value(1), "threads accepting connections, each on a listening socket of its own")
+    ("max-connections", po::value<int64_t>(&max_connections_)->default_value(0), "max open connections, at the limit the oldest connection that has not sent a message yet is closed to make room for a new one, or the new one if there is none, 0 means no limit")
+    ("idle-timeout", po::value<int64_t>(&idle_timeout_)->default_value(0), "milliseconds a client may take to finish a message it started sending before it is closed, and after about how long without an answer to TCP keepalive probes a vanished peer is closed, 0 disables both (quiet clients between messages, like spectators, are not closed while they are there)")
+    ("max-input-rate", po::value<int64_t>(&max_input_rate_)->default_value(0), "max messages per second read from a connection, 0 means no limit")
+    ;
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+
+  if (vm.count("help")) {
+    // Print the help message.
+    std::cout << desc << "\n";
+    exit(EXIT_SUCCESS);
+  }
+  po::notify(vm);
+
+  bound_check(bomb_timer_, bomb_timer, "bomb timer");
+  bound_check(players_count_, players_count, "players count");
+  bound_check(explosion_radius_, explosion_radius, "explosion radius", false);
+  bound_check(initial_blocks_, initial_blocks, "initial blocks", false);
+  bound_check(game_length_, game_length, "game length");
+  bound_check(port_, port, "port");
+  bound_check(seed_, seed, "seed", false);
+  bound_check(size_x_, size_x, "size x");
+  bound_check(size_y_, size_y, "size y");
+  // Clients refuse a Hello announcing a board they cannot keep.
+  if ((uint64_t) size_x * size_y > ParseLimits::MAX_CELLS)
+    throw OptionsError(
+      "Please provide a board of at most " +
+      std::to_string(ParseLimits::MAX_CELLS) + " cells"
+    );
+  bound_check(max_write_batch_, max_write_batch, "max write batch");
+  bound_check(stats_port_, stats_port, "stats port", false);
+  bound_check(interest_radius_, interest_radius, "interest radius", false);
+  bound_check(explosion_threads_, explosion_threads, "explosion threads");
+  bound_check(acceptors_, acceptors, "acceptors");
+  bound_check(max_connections_, max_connections, "max connections", false);
+  bound_check(idle_timeout_, idle_timeout, "idle timeout", false);
+  bound_check(max_input_rate_, max_input_rate, "max input rate", false);
+  log_level = parse_log_level(log_level_);
+  io_backend = parse_io_backend(io_backend_);
 }
\ No newline at end of file
@@ -1,40 +1,61 @@
-#ifndef PROGRAM_OPTIONS_HPP
-#define PROGRAM_OPTIONS_HPP
-#include <string>
-#include <exception>
-
-class OptionsError : public std::invalid_argument {
-public:
-  OptionsError(std::string const& e) : std::invalid_argument(e) {}
-};
-
-// Struct for parsing and storing all client options from the command line.
-struct ClientOptions {
-  std::string gui_address,
-              gui_port,
-              player_name,
-              server_address,
-              server_port;
-  uint16_t port;
-
-  ClientOptions(int, char*[]);
-};
-
-// Struct for parsing and storing all server options from the command line.
-struct ServerOptions {
-  std::string server_name;
-  uint16_t bomb_timer,
-           explosion_radius,
-           initial_blocks,
-           game_length,
-           port,
-           size_x,
-           size_y;
-  uint8_t players_count;
-  uint64_t turn_duration;
-  uint32_t seed;  
-
-  ServerOptions(int, char*[]);       
-};
-
+#ifndef PROGRAM_OPTIONS_HPP
+#define PROGRAM_OPTIONS_HPP
+#include <string>
+#include <exception>
+#include "messages.hpp"
+#include "logging.hpp"
+
+class OptionsError : public std::invalid_argument {
+public:
+  OptionsError(std::string const& e) : std::invalid_argument(e) {}
+};
+
+// Struct for parsing and storing all client options from the command line.
+struct ClientOptions {
+  // Set instead of the gui address and port for a gui on a local socket.
+  std::string gui_socket;
+  std::string gui_address,
+              gui_port,
+              player_name,
+              server_address,
+              server_port;
+  uint16_t port,
+           max_gui_rate,
+           reconnect_attempts;
+  ProtocolVersion protocol_version;
+  LogLevel log_level;
+  IoBackend io_backend;
+  // Asks the server for state hashes and checks the board against them.
+  bool verify_state;
+
+  ClientOptions(int, char*[]);
+};
+
+// Struct for parsing and storing all server options from the command line.
+struct ServerOptions {
+  std::string server_name;
+  uint16_t bomb_timer,
+           explosion_radius,
+           initial_blocks,
+           game_length,
+           port,
+           size_x,
+           size_y;
+  uint8_t players_count;
+  uint16_t max_write_batch,
+           stats_port,
+           interest_radius,
+           explosion_threads,
+           acceptors;
+  uint32_t max_connections,
+           idle_timeout;
+  uint16_t max_input_rate;
+  uint64_t turn_duration;
+  uint32_t seed;  
+  LogLevel log_level;
+  IoBackend io_backend;
+
+  ServerOptions(int, char*[]);       
+};
+
 #endif // PROGRAM_OPTIONS_HPP
\ No newline at end of file
@@ -1,300 +1,602 @@
-#include <iostream>
-#include <string>
-#include <exception>
-#include <boost/asio.hpp>
-#include <set>
-#include <utility>
-#include <mutex>
-#include <condition_variable>
-#include <thread>
-#include "program_options.hpp"
-#include "messages.hpp"
-#include "connections.hpp"
-#include "misc.hpp"
-
-namespace {
-  // Mutex and conditional variable used for safely closing
-  // all connections in case of an error.
-  static std::mutex end_mutex;
-  static std::condition_variable end_condition;
-  static bool end{false};
-
-  // Client class, responsible for establishing connection with the server
-  // and GUI, receiving and sending messages and keeping track of thestate
-  // of the game.
-  class Client {
-  private:
-    enum struct GameState {
-      Lobby = 0, Game = 1
-    };
-
-    std::mutex state_mutex;
-    GameState game_state{GameState::Lobby};
-    boost::asio::io_context io_context{};
-    std::string player_name;
-    TCPConnection server_conn;
-    UDPConnection gui_conn;
-
-    // Helper function to find all squares on the map
-    // that have exploded in the current event.
-    void calculate_explosions(const Event &event, ClientToGUI& out) {
-      if (event.type != EventType::BombExploded)
-        throw std::runtime_error("Something went wrong");
-      static std::vector<std::pair<int32_t,int32_t>> sides = {
-        {1,0}, {0,1}, {-1, 0}, {0, -1}
-      };
-      for (const std::pair<int32_t, int32_t> &side : sides) {
-        Position p = out.bombs[event.bomb_id].position;
-        int32_t x = p.x, y = p.y;
-        for (uint16_t i = 0; i <= out.explosion_radius; i++) {
-          p = Position((uint16_t) x, (uint16_t) y);
-          out.explosions.insert(p);
-          // If the explosion reaches a block, it stops.
-          if (out.blocks.contains(p))
-            break;
-          x += side.first;
-          y += side.second;
-          if (x == -1 || x == out.size_x || y == -1 || y == out.size_y)
-            break;
-        }
-      }
-    }
-
-    // Helper function to process one turn's events.
-    void process_events(
-      const std::vector<Event> &events,
-      ClientToGUI& out,
-      std::set<Player::PlayerId> &robots_destroyed,
-      std::set<Position> &blocks_destroyed
-      ) {
-      for (const Event &event : events) {
-        switch (event.type) {
-          case EventType::BombPlaced:
-            out.bombs[event.bomb_id] =
-              Bomb(event.position, out.bomb_timer);
-            break;
-          case EventType::BombExploded:
-            calculate_explosions(event, out);
-            for (const Position &position : event.blocks_destroyed)
-              blocks_destroyed.insert(position);
-            for (const Player::PlayerId &id : event.robots_destroyed)
-              robots_destroyed.insert(id);
-            out.bombs.erase(event.bomb_id);
-            break;
-          case EventType::PlayerMoved:
-            out.player_positions[event.player_id] = event.position;
-            break;
-          case EventType::BlockPlaced:
-            out.blocks.insert(event.position);
-        }
-      }
-    }
-
-  public:
-    Client(ClientOptions &options)
-    : player_name(options.player_name),
-      server_conn(io_context, options.server_address, options.server_port),
-      gui_conn(io_context, options.port, options.gui_address, options.gui_port) {}
-
-    ServerToClient receive_from_server() {
-      ServerToClient in(server_conn);
-      return in;
-    }
-
-    ClientToGUI& process_server_message(const ServerToClient& in) {
-      // The `out` message will statically hold all information
-      // about the game state that gui will use.
-      static ClientToGUI out;
-      static std::set<Player::PlayerId> robots_destroyed;
-      static std::set<Position> blocks_destroyed;
-      // Guards access to the game_state variable.
-      std::lock_guard<std::mutex> lock(state_mutex);
-
-      switch (in.type) {
-        case ServerToClientType::Hello:
-          debug("Received Hello from server");
-          out.server_name = in.server_name;
-          out.player_count = in.player_count;
-          out.size_x = in.size_x;
-          out.size_y = in.size_y;
-          out.game_length = in.game_length;
-          out.explosion_radius = in.explosion_radius;
-          out.bomb_timer = in.bomb_timer;
-          break;
-        case ServerToClientType::AcceptedPlayer:
-          debug("Received Accepted Player from server");
-          out.players[in.player_id] = in.player;
-          out.scores[in.player_id] = 0;
-          break;
-        case ServerToClientType::GameStarted:
-          debug("Received Game Started from server");
-          game_state = GameState::Game;
-          out.players = in.players;
-          out.scores.clear();
-          for (const auto &[id, player] : out.players)
-            out.scores[id] = 0;
-          out.player_positions.clear();
-          out.blocks.clear();
-          out.bombs.clear();
-          break;
-        case ServerToClientType::Turn:
-          debug("Received Turn from server");
-          out.explosions.clear();
-          robots_destroyed.clear();
-          blocks_destroyed.clear();
-          out.turn = in.turn;
-
-          // Decrease bomb timers
-          for (auto &[id, bomb] : out.bombs)
-            bomb.timer--;
-
-          // Process this turn's events.
-          process_events(in.events, out, robots_destroyed, blocks_destroyed);
-
-          // Calculate the scores for this turn and erase destroyed
-          // blocks.
-          for (const Position &position : blocks_destroyed)
-            out.blocks.erase(position);
-          for (const Player::PlayerId &id : robots_destroyed)
-            out.scores[id]++;
-          break;
-        case ServerToClientType::GameEnded:
-          debug("Received Game Ended from server");
-          game_state = GameState::Lobby;
-          out.players.clear();
-          out.scores.clear();
-          break;
-      }
-      out.type = static_cast<ClientToGUIType>(game_state);
-      return out;
-    }
-
-    GUIToClient receive_from_gui() {
-      GUIToClient in(gui_conn);
-      if (gui_conn.has_more())
-        throw GUIReadError();
-      return in;
-    }
-
-    ClientToServer& process_gui_message(const GUIToClient& in) {
-      static ClientToServer out;
-      // Guards access to the game state variable.
-      std::lock_guard<std::mutex> lock(state_mutex);
-
-      // If the game is in lobby state, send a JOIN
-      // message to the server regardless of `in` type.
-      if (game_state == GameState::Lobby) {
-        debug("Received Join from GUI");
-        out.type = ClientToServerType::Join;
-        out.name = player_name;
-      }
-      else {
-        switch (in.type) {
-          case GUIToClientType::PlaceBomb:
-            debug("Received PlaceBomb from GUI");
-            out.type = ClientToServerType::PlaceBomb;
-            break;
-          case GUIToClientType::PlaceBlock:
-            debug("Received PlaceBlock from GUI");
-            out.type = ClientToServerType::PlaceBlock;
-            break;
-          case GUIToClientType::Move:
-            debug("Received Move from GUI");
-            out.type = ClientToServerType::Move;
-            out.direction = in.direction;
-            break;
-        }
-      }
-
-      return out;
-    }
-
-    void send_gui_message(ClientToGUI &message) {
-      static Buffer serialized;
-      message.serialize(serialized);
-      gui_conn.write(serialized);
-    }
-
-    void send_server_message(ClientToServer &message) {
-      static Buffer serialized;
-      message.serialize(serialized);
-      server_conn.write(serialized);
-    }
-
-    void close_sockets() {
-      server_conn.close();
-      gui_conn.close();
-    }
-  };
-
-  // Handles exception in the worker threads
-  // by waking up the main thread.
-  void handle_exception(std::exception &e) {
-    std::unique_lock lock(end_mutex);
-    if (end)
-      return;
-    end = true;
-    end_condition.notify_all();
-    std::cerr << "ERROR : " << e.what() << "\n";
-  }
-
-  void server_messages_handler(Client &client) {
-    for (;;) {
-      try {
-        ServerToClient in = client.receive_from_server();
-        ClientToGUI out = client.process_server_message(in);
-        if (in.type != ServerToClientType::GameStarted)
-          client.send_gui_message(out);
-      }
-      catch (std::exception &e) {
-        handle_exception(e);
-        return;
-      }
-    }
-  }
-
-  void gui_messages_handler(Client &client) {
-    for (;;) {
-      try {
-        GUIToClient in = client.receive_from_gui();
-        ClientToServer out = client.process_gui_message(in);
-        client.send_server_message(out);
-      }
-      catch (GUIReadError &e) {
-        // If the message is corrupted, ignore it.
-        continue;
-      }
-      catch (std::exception &e) {
-        handle_exception(e);
-        return;
-      }
-    }
-  }
-} // anonymous namespace
-
-int main(int argc, char *argv[]) {
-  try {
-    ClientOptions options = ClientOptions(argc, argv);
-    Client client(options);
-    // Starting to listen for messages.
-    std::thread server_thread(server_messages_handler, std::ref(client));
-    std::thread gui_thread(gui_messages_handler, std::ref(client));
-    debug("Listening for GUI messages on port " + std::to_string(options.port));
-
-    // Waiting for any exceptions in the threads.
-    std::unique_lock lock(end_mutex);
-    end_condition.wait(lock, []{return end;});
-    end_mutex.unlock();
-
-    debug("Closing connection");
-    client.close_sockets();
-    server_thread.join();
-    gui_thread.join();
-    exit(EXIT_FAILURE);
-  }
-  catch (std::exception &e) {
-    std::cerr << "ERROR : " << e.what() << "\n";
-    exit(EXIT_FAILURE);
-  }
-  return 0;
+#include <iostream>
+#include <string>
+#include <exception>
+#include <utility>
+#include <boost/asio.hpp>
+#include <vector>
+#include <bitset>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <array>
+#include <memory>
+#include "program_options.hpp"
+#include "messages.hpp"
+#include "connections.hpp"
+#include "logging.hpp"
+#include "alloc_check.hpp"
+#include "lock_profile.hpp"
+
+namespace {
+  // Mutex and conditional variable used for safely closing
+  // all connections in case of an error.
+  static std::mutex end_mutex;
+  static std::condition_variable end_condition;
+  static bool end{false};
+
+  // Reconnect attempts wait this long times the attempt's number.
+  constexpr std::chrono::milliseconds RECONNECT_DELAY{100};
+
+  // Hands serialized GUI states from the server reader to the GUI
+  // sender through three buffers: the reader fills one, the sender
+  // writes another one out and the third holds the newest finished
+  // state. A state the sender had no time for is replaced by the next
+  // one instead of being queued.
+  class StateExchange {
+  public:
+    // Returns the empty buffer for the next state.
+    Buffer& back() {
+      buffers[back_index].clear();
+      return buffers[back_index];
+    }
+
+    // Publishes the state written to back(). The swap keeps a CLOSED
+    // bit set by a concurrent close().
+    void publish() {
+      uint8_t current = middle.load(std::memory_order_relaxed);
+      while (!middle.compare_exchange_weak(
+               current,
+               (current & CLOSED) | back_index | FRESH,
+               std::memory_order_acq_rel,
+               std::memory_order_relaxed
+             )) {}
+      back_index = current & INDEX;
+      middle.notify_one();
+    }
+
+    // Waits for a state newer than the last one taken. Returns nullptr
+    // after close(), otherwise the buffer stays valid until next call.
+    Buffer* take() {
+      uint8_t current = middle.load(std::memory_order_acquire);
+      for (;;) {
+        if (current & CLOSED)
+          return nullptr;
+        if (!(current & FRESH)) {
+          middle.wait(current, std::memory_order_acquire);
+          current = middle.load(std::memory_order_acquire);
+        }
+        // Fails if close() came in between, which is then seen.
+        else if (middle.compare_exchange_weak(
+                   current,
+                   front_index,
+                   std::memory_order_acq_rel,
+                   std::memory_order_acquire
+                 )) {
+          front_index = current & INDEX;
+          return &buffers[front_index];
+        }
+      }
+    }
+
+    void close() {
+      middle.fetch_or(CLOSED, std::memory_order_release);
+      middle.notify_one();
+    }
+
+  private:
+    static constexpr uint8_t INDEX = 3, FRESH = 4, CLOSED = 8;
+
+    std::array<Buffer, 3> buffers;
+    // Owned by the reader and the sender respectively.
+    uint8_t back_index{0}, front_index{1};
+    std::atomic<uint8_t> middle{2};
+  };
+
+  // Opens a local socket if the GUI is on one, otherwise UDP.
+  std::unique_ptr<DatagramConnection> connect_gui(
+    boost::asio::io_context &io_context,
+    ClientOptions &options
+    ) {
+    if (!options.gui_socket.empty()) {
+      return std::make_unique<UnixConnection>(
+        io_context, options.gui_socket + ".client", options.gui_socket
+      );
+    }
+    return std::make_unique<UDPConnection>(
+      io_context, options.port, options.gui_address, options.gui_port
+    );
+  }
+
+  // Client class, responsible for establishing connection with the server
+  // and GUI, receiving and sending messages and keeping track of thestate
+  // of the game.
+  class Client {
+  private:
+    enum struct GameState {
+      Lobby = 0, Game = 1
+    };
+
+    ProfiledMutex state_mutex;
+    GameState game_state{GameState::Lobby};
+    boost::asio::io_context io_context{};
+    std::string player_name;
+    ProtocolVersion protocol_version;
+    // Encoding state of the stream from the server.
+    Codec codec;
+    ProfiledMutex server_write_mutex;
+    std::string server_address, server_port;
+    // Replaced by the server reader when reconnecting, which is
+    // guarded by server_write_mutex.
+    std::unique_ptr<TCPConnection> server_conn;
+    std::unique_ptr<DatagramConnection> gui_conn;
+    StateExchange gui_states;
+
+    // The state shown by the GUI, guarded by state_mutex like the
+    // frame variables below.
+    ClientToGUI out;
+    // With a limited GUI rate, states arriving too early are merged
+    // into the pending frame, which is sent once it is due.
+    std::chrono::steady_clock::duration frame_interval;
+    std::chrono::steady_clock::time_point next_frame{};
+    bool frame_pending{false};
+    // Wakes the frame timer about a pending frame or closing.
+    ProfiledCondition frame_due;
+    bool closing{false};
+    // Explosions are shown until the first turn after a frame, other
+    // messages asking for a frame do not bring new ones.
+    bool explosions_shown{false};
+
+    // The server keeps the last action of each player in a turn, so
+    // inputs are coalesced the same way: only the latest one is held and
+    // it is sent once per turn, when the turn arrives. Join is sent once
+    // per lobby. Guarded by state_mutex.
+    std::optional<ClientToServer> pending_action;
+    bool joined{false};
+
+    // With reconnecting enabled, the client asks the server for a
+    // session. When the connection is lost, it connects again and
+    // resumes the session from the first turn it has not seen, keeping
+    // its state and the GUI. Guarded by state_mutex.
+    uint16_t reconnect_attempts;
+    uint64_t session_token{0};
+    bool resuming{false};
+
+    // With state verification, the server sends the hash of its state
+    // after every turn. A board that differs from the server's is
+    // dropped and the session resumed from its first turn, which brings
+    // a snapshot or a replay of the game. Guarded by state_mutex.
+    bool verify_state;
+    bool resync{false};
+
+    // Applying a turn and serializing the frame reuse the memory
+    // of the previous turns.
+    AllocationBudget turn_allocations{"Turn", 0, 16};
+
+    // Called with state_mutex held.
+    void publish_frame() {
+      out.serialize(gui_states.back());
+      gui_states.publish();
+      frame_pending = false;
+      explosions_shown = true;
+      if (frame_interval.count() != 0)
+        next_frame = std::chrono::steady_clock::now() + frame_interval;
+    }
+
+    // Called with state_mutex held.
+    void request_frame() {
+      frame_pending = true;
+      if (frame_interval.count() == 0 ||
+          std::chrono::steady_clock::now() >= next_frame)
+        publish_frame();
+      else
+        frame_due.notify_one();
+    }
+
+  public:
+    Client(ClientOptions &options)
+    : player_name(options.player_name),
+      protocol_version(options.protocol_version),
+      server_address(options.server_address),
+      server_port(options.server_port),
+      server_conn(std::make_unique<TCPConnection>(
+        io_context, server_address, server_port
+      )),
+      gui_conn(connect_gui(io_context, options)),
+      frame_interval(
+        options.max_gui_rate == 0
+        ? std::chrono::steady_clock::duration::zero()
+        : std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::seconds(1)) / options.max_gui_rate
+      ),
+      reconnect_attempts(options.reconnect_attempts),
+      verify_state(options.verify_state) {}
+
+    ServerToClient receive_from_server() {
+      ServerToClient in(*server_conn, codec);
+      return in;
+    }
+
+    void process_server_message(const ServerToClient& in) {
+      std::optional<AllocationBudget::Run> allocations;
+      if (in.type == ServerToClientType::Turn)
+        allocations.emplace(turn_allocations);
+      // Written to the server once the state is unlocked.
+      std::optional<ClientToServer> action;
+      // Guards access to the game state and the frame variables.
+      std::unique_lock lock = profiled_lock(state_mutex);
+
+      switch (in.type) {
+        case ServerToClientType::Hello:
+          {
+          debug("Received Hello from server");
+          // A resumed session keeps its board if it has the same size.
+          bool same_board = resuming &&
+            out.size_x == in.size_x && out.size_y == in.size_y;
+          out.server_name = in.server_name;
+          out.player_count = in.player_count;
+          out.size_x = in.size_x;
+          out.size_y = in.size_y;
+          out.game_length = in.game_length;
+          out.explosion_radius = in.explosion_radius;
+          out.bomb_timer = in.bomb_timer;
+          if (!same_board)
+            out.blocks.resize(in.size_x, in.size_y);
+          break;
+          }
+        case ServerToClientType::AcceptedPlayer:
+          debug("Received Accepted Player from server");
+          // After reconnecting, the game may have ended in the meantime.
+          if (game_state == GameState::Game) {
+            game_state = GameState::Lobby;
+            joined = false;
+            session_token = 0;
+            out.players.fill(std::nullopt);
+            out.scores.fill(0);
+          }
+          out.players[in.player_id] = in.player;
+          out.scores[in.player_id] = 0;
+          break;
+        case ServerToClientType::GameStarted:
+          debug("Received Game Started from server");
+          game_state = GameState::Game;
+          pending_action.reset();
+          out.players.fill(std::nullopt);
+          for (const auto &[id, player] : in.players)
+            out.players[id] = player;
+          out.clear_board();
+          out.reserve(codec.limits);
+          break;
+        case ServerToClientType::Turn:
+          debug("Received Turn from server");
+          // Turns merged into one frame show all their explosions.
+          if (explosions_shown) {
+            out.explosions.clear();
+            explosions_shown = false;
+          }
+          out.apply_turn(in.turn, in.events);
+
+          // The server has taken this turn's action, send the next one.
+          action.swap(pending_action);
+          break;
+        case ServerToClientType::GameEnded:
+          debug("Received Game Ended from server");
+          game_state = GameState::Lobby;
+          joined = false;
+          session_token = 0;
+          out.players.fill(std::nullopt);
+          out.scores.fill(0);
+          break;
+        case ServerToClientType::ProtocolAccepted:
+          debug("Received Protocol Accepted from server");
+          break;
+        case ServerToClientType::Session:
+          debug("Received Session from server");
+          session_token = in.token;
+          break;
+        case ServerToClientType::Snapshot:
+          debug("Received Snapshot from server");
+          out.apply_snapshot(in);
+          explosions_shown = false;
+          break;
+        case ServerToClientType::StateHash:
+          if (in.turn != out.turn || in.state_hash == out.state_hash())
+            return;
+          info("State differs from the server's after turn {}", in.turn);
+          // Without a session the board can not be fetched again.
+          if (reconnect_attempts == 0 || session_token == 0)
+            return;
+          resync = true;
+          // The server reader reconnects and resumes the session.
+          throw std::runtime_error("State differs from the server's");
+      }
+      out.type = static_cast<ClientToGUIType>(game_state);
+      if (in.type != ServerToClientType::GameStarted &&
+          in.type != ServerToClientType::ProtocolAccepted &&
+          in.type != ServerToClientType::Session)
+        request_frame();
+      lock.unlock();
+      if (action)
+        send_server_message(*action);
+    }
+
+    GUIToClient receive_from_gui() {
+      GUIToClient in(*gui_conn);
+      if (gui_conn->has_more())
+        throw GUIReadError();
+      return in;
+    }
+
+    void process_gui_message(const GUIToClient& in) {
+      ClientToServer out;
+      // Guards access to the game state and the input variables.
+      std::unique_lock lock = profiled_lock(state_mutex);
+
+      // If the game is in lobby state, send a JOIN
+      // message to the server regardless of `in` type.
+      if (game_state == GameState::Lobby) {
+        debug("Received Join from GUI");
+        if (joined)
+          return;
+        out.type = ClientToServerType::Join;
+        out.name = player_name;
+        joined = true;
+        lock.unlock();
+        send_server_message(out);
+      }
+      else {
+        switch (in.type) {
+          case GUIToClientType::PlaceBomb:
+            debug("Received PlaceBomb from GUI");
+            out.type = ClientToServerType::PlaceBomb;
+            break;
+          case GUIToClientType::PlaceBlock:
+            debug("Received PlaceBlock from GUI");
+            out.type = ClientToServerType::PlaceBlock;
+            break;
+          case GUIToClientType::Move:
+            debug("Received Move from GUI");
+            out.type = ClientToServerType::Move;
+            out.direction = in.direction;
+            break;
+        }
+        pending_action = out;
+      }
+    }
+
+    // Sends the newest published state, returns false once closed.
+    bool send_gui_message() {
+      Buffer *serialized = gui_states.take();
+      if (serialized == nullptr)
+        return false;
+      gui_conn->write(*serialized);
+      return true;
+    }
+
+    // Publishes pending frames once they are due, until the client
+    // closes. A state merged into a frame is sent at the frame's time
+    // even if no other message follows it, which may take long in a
+    // lobby. Without a rate limit frames are never left pending.
+    void publish_due_frames() {
+      if (frame_interval.count() == 0)
+        return;
+      std::unique_lock lock = profiled_lock(state_mutex);
+      while (!closing) {
+        if (!frame_pending)
+          frame_due.wait(lock);
+        else if (std::chrono::steady_clock::now() >= next_frame)
+          publish_frame();
+        else
+          frame_due.wait_until(lock, next_frame);
+      }
+    }
+
+    // Asks the server for a newer protocol, in reply to Hello.
+    void negotiate() {
+      if (protocol_version == ProtocolVersion::Classic)
+        return;
+      ClientToServer out;
+      out.type = ClientToServerType::Negotiate;
+      out.version = protocol_version;
+      send_server_message(out);
+    }
+
+    // Asks the server for state hashes, in reply to Hello.
+    void request_state_hashes() {
+      if (!verify_state)
+        return;
+      ClientToServer out;
+      out.type = ClientToServerType::VerifyState;
+      send_server_message(out);
+    }
+
+    // Asks the server to resume the session after reconnecting,
+    // or for a new session.
+    void start_session() {
+      if (reconnect_attempts == 0)
+        return;
+      std::unique_lock lock = profiled_lock(state_mutex);
+      ClientToServer message;
+      message.type = ClientToServerType::Resume;
+      message.token = 0;
+      message.turn = 0;
+      if (resuming && game_state == GameState::Game && session_token != 0) {
+        // A board found to be wrong is built again from the start.
+        if (resync)
+          out.clear_board();
+        message.token = session_token;
+        message.turn = (uint16_t) (out.turn + 1);
+      }
+      else if (resuming) {
+        // The server does not know this connection, join again.
+        joined = false;
+      }
+      resuming = false;
+      resync = false;
+      lock.unlock();
+      send_server_message(message);
+    }
+
+    // Connects to the server again after the connection was lost,
+    // keeping the game state and the GUI connection.
+    bool reconnect() {
+      for (uint16_t attempt = 1; attempt <= reconnect_attempts; attempt++) {
+        std::this_thread::sleep_for(RECONNECT_DELAY * attempt);
+        try {
+          auto conn = std::make_unique<TCPConnection>(
+            io_context, server_address, server_port
+          );
+          {
+            std::unique_lock lock = profiled_lock(server_write_mutex);
+            server_conn = std::move(conn);
+          }
+          codec = Codec();
+          std::unique_lock lock = profiled_lock(state_mutex);
+          resuming = true;
+          pending_action.reset();
+          debug("Reconnected to server after {} attempts", attempt);
+          return true;
+        }
+        catch (std::exception &e) {
+          debug("Reconnecting to server failed");
+        }
+      }
+      return false;
+    }
+
+    void send_server_message(ClientToServer &message) {
+      // Both handler threads may write to the server.
+      std::unique_lock lock = profiled_lock(server_write_mutex);
+      static Buffer serialized;
+      message.serialize(serialized);
+      try {
+        server_conn->write(serialized);
+      }
+      catch (std::exception &e) {
+        // The server reader notices the lost connection and reconnects.
+        if (reconnect_attempts == 0)
+          throw;
+        serialized.clear();
+      }
+    }
+
+    void close_sockets() {
+      {
+        std::unique_lock lock = profiled_lock(server_write_mutex);
+        server_conn->close();
+      }
+      gui_conn->close();
+      gui_states.close();
+      std::unique_lock lock = profiled_lock(state_mutex);
+      closing = true;
+      frame_due.notify_all();
+    }
+  };
+
+  bool ending() {
+    std::lock_guard lock(end_mutex);
+    return end;
+  }
+
+  // Handles exception in the worker threads
+  // by waking up the main thread.
+  void handle_exception(std::exception &e) {
+    std::unique_lock lock(end_mutex);
+    if (end)
+      return;
+    end = true;
+    end_condition.notify_all();
+    std::cerr << "ERROR : " << e.what() << "\n";
+  }
+
+  void server_messages_handler(Client &client) {
+    for (;;) {
+      try {
+        ServerToClient in = client.receive_from_server();
+        client.process_server_message(in);
+        if (in.type == ServerToClientType::Hello) {
+          client.negotiate();
+          client.request_state_hashes();
+          client.start_session();
+        }
+      }
+      catch (std::exception &e) {
+        if (!ending() && client.reconnect())
+          continue;
+        handle_exception(e);
+        return;
+      }
+    }
+  }
+
+  // Sends states to the GUI, so that reading from the server
+  // never waits for the GUI socket.
+  void gui_sender_handler(Client &client) {
+    try {
+      while (client.send_gui_message()) {}
+    }
+    catch (std::exception &e) {
+      handle_exception(e);
+    }
+  }
+
+  // Publishes frames held back by the GUI rate limit once they are due.
+  void gui_frame_handler(Client &client) {
+    client.publish_due_frames();
+  }
+
+  void gui_messages_handler(Client &client) {
+    for (;;) {
+      try {
+        GUIToClient in = client.receive_from_gui();
+        client.process_gui_message(in);
+      }
+      catch (GUIReadError &e) {
+        // If the message is corrupted, ignore it.
+        continue;
+      }
+      catch (std::exception &e) {
+        handle_exception(e);
+        return;
+      }
+    }
+  }
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  // Before the logger or any other thread starts.
+  dump_lock_profile_on_signal();
+  try {
+    ClientOptions options = ClientOptions(argc, argv);
+    Logger::set_level(options.log_level);
+    if (set_io_backend(options.io_backend) != options.io_backend)
+      info("io_uring is not available, using asio");
+    Client client(options);
+    // Starting to listen for messages.
+    std::thread server_thread(server_messages_handler, std::ref(client));
+    std::thread gui_thread(gui_messages_handler, std::ref(client));
+    std::thread gui_sender_thread(gui_sender_handler, std::ref(client));
+    std::thread gui_frame_thread(gui_frame_handler, std::ref(client));
+    debug("Listening for GUI messages on port {}", options.port);
+
+    // Waiting for any exceptions in the threads.
+    std::unique_lock lock(end_mutex);
+    end_condition.wait(lock, []{return end;});
+    end_mutex.unlock();
+
+    debug("Closing connection");
+    client.close_sockets();
+    server_thread.join();
+    gui_thread.join();
+    gui_sender_thread.join();
+    gui_frame_thread.join();
+    exit(EXIT_FAILURE);
+  }
+  catch (std::exception &e) {
+    std::cerr << "ERROR : " << e.what() << "\n";
+    exit(EXIT_FAILURE);
+  }
+  return 0;
 }
\ No newline at end of file
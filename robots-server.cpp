@@ -1,4 +1,5 @@
 #include <iostream>
+#include <utility>
 #include <boost/asio.hpp>
 #include <thread>
 #include <vector>
@@ -7,14 +8,130 @@
 #include <chrono>
 #include <random>
 #include <string>
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <memory_resource>
+#include <netinet/tcp.h>
 #include "program_options.hpp"
 #include "messages.hpp"
 #include "connections.hpp"
-#include "misc.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "interest.hpp"
+#include "game.hpp"
+#include "alloc_check.hpp"
+#include "lock_profile.hpp"
 
 namespace {
   using tcp = boost::asio::ip::tcp;
 
+  // How long a client connecting during a game has to resume its session.
+  constexpr std::chrono::milliseconds RESUME_GRACE{200};
+
+  // Metrics of the server's hot paths, served on the stats port.
+  struct ServerMetrics {
+    Histogram turn_duration_us, write_bytes, client_lag_turns, lock_wait_ns;
+    Counter turns, sent_bytes, connections, disconnections;
+    Counter rejected_connections, evicted_connections, idle_disconnections;
+#ifdef ALLOC_CHECK
+    Histogram turn_allocations;
+#endif
+
+    std::string dump() const {
+      std::string out;
+      turn_duration_us.dump(out, "robots_turn_duration_us");
+#ifdef ALLOC_CHECK
+      turn_allocations.dump(out, "robots_turn_allocations");
+#endif
+      write_bytes.dump(out, "robots_write_bytes");
+      client_lag_turns.dump(out, "robots_client_lag_turns");
+      lock_wait_ns.dump(out, "robots_server_mutex_wait_ns");
+      turns.dump(out, "robots_turns_total");
+      sent_bytes.dump(out, "robots_sent_bytes_total");
+      connections.dump(out, "robots_connections_total");
+      disconnections.dump(out, "robots_disconnections_total");
+      rejected_connections.dump(out, "robots_rejected_connections_total");
+      evicted_connections.dump(out, "robots_evicted_connections_total");
+      idle_disconnections.dump(out, "robots_idle_disconnections_total");
+      dump_lock_profile(out);
+      return out;
+    }
+  };
+
+  // Wakes up a single sender thread. Publishers bump the counter, and
+  // the futex behind notify_one is only touched if the sender waits.
+  struct Wakeup {
+    std::atomic<uint32_t> counter{0};
+    // Atomic waits can not time out, so a sender waiting with a deadline
+    // waits on the condition instead. Publishers lock its mutex only
+    // while such a sender is waiting.
+    std::atomic<bool> timed_waiting{false};
+    ProfiledMutex timed_mutex;
+    ProfiledCondition timed;
+
+    void notify() {
+      counter.fetch_add(1, std::memory_order_seq_cst);
+      counter.notify_one();
+      // Either this sees the waiter or the waiter sees the new count.
+      if (timed_waiting.load(std::memory_order_seq_cst)) {
+        { std::unique_lock lock = profiled_lock(timed_mutex); }
+        timed.notify_one();
+      }
+    }
+
+    // Waits until the counter changes from `seen` or the deadline passes.
+    void wait_until(
+      uint32_t seen,
+      std::chrono::steady_clock::time_point deadline
+      ) {
+      std::unique_lock lock = profiled_lock(timed_mutex);
+      timed_waiting.store(true, std::memory_order_seq_cst);
+      timed.wait_until(lock, deadline, [&] {
+        return counter.load(std::memory_order_seq_cst) != seen;
+      });
+      timed_waiting.store(false, std::memory_order_relaxed);
+    }
+  };
+
+  struct Client;
+
+  // Log of everything sender threads broadcast about one game, from the
+  // lobby to its end. Entries are numbered (players by join order, turns
+  // by number) and written once, before the matching count is published
+  // with a release store, so senders read them without any lock. The
+  // log is shared, so lagging senders can finish a game after the
+  // server moved on to the next one.
+  struct GameLog {
+    std::array<Player, 256> players;
+    std::atomic<uint16_t> joined{0};
+    std::atomic<bool> started{false};
+    std::unique_ptr<std::vector<Event>[]> turns;
+    // Zobrist hash of the state at the end of each turn.
+    std::unique_ptr<uint64_t[]> hashes;
+    std::atomic<uint32_t> published_turns{0};
+    std::map<Player::PlayerId, Player::Score> scores;
+    std::atomic<bool> ended{false};
+    // Session tokens of the players, written with the player, zero if
+    // the player's client did not ask for a session.
+    std::array<uint64_t, 256> tokens{};
+    // Connections the players joined from, written with the player.
+    // Only compared, so senders find their player without relying on
+    // addresses.
+    std::array<const Client*, 256> clients{};
+    // With interest management, what the filters query instead of the
+    // whole turns, written with every turn.
+    std::unique_ptr<InterestIndex> interest;
+
+    GameLog(const ServerOptions &options)
+    : turns(std::make_unique<std::vector<Event>[]>(options.game_length + 1)),
+      hashes(std::make_unique<uint64_t[]>(options.game_length + 1)) {
+      if (options.interest_radius > 0)
+        interest = std::make_unique<InterestIndex>(options);
+    }
+  };
+  using GameLogPtr = std::shared_ptr<GameLog>;
+
   // Server class, holding all game related variables.
   class Server {
   public:
@@ -26,65 +143,151 @@ namespace {
     GameState game_state{GameState::Lobby};
     uint8_t current_id{0};
     std::map<Player::PlayerId, Player> players;
-    std::map<Player::PlayerId, Player::Score> scores;
-    uint16_t current_turn{0};
-    std::vector<std::vector<Event>> turns;
-    std::map<Player::PlayerId, Position> player_positions;
-    std::set<Position> blocks;
-    std::map<Bomb::BombId, Bomb> bombs;
-    Bomb::BombId current_bomb{0};
+    GameLogPtr log;
 
     // Server variables.
     boost::asio::io_context io_context{};
-    std::mutex server_mutex;
-    std::condition_variable new_players, game_start, new_turn;
+    ProfiledMutex server_mutex;
+    ProfiledCondition game_start;
     ServerOptions options;
-    std::minstd_rand random;
+    // Board of the running game. Receiver threads publish the players'
+    // actions to its input slots and the game handler takes them once
+    // per turn, both without locking.
+    Game game;
+    std::mt19937_64 token_random{std::random_device{}()};
     uint32_t iteration{0};
+    ServerMetrics metrics;
 
-    // Variables for client connections handling.
-    std::mutex moves_mutex;
-    std::map<Player::PlayerId, ClientToServer> player_moves{};
+    // Sender threads, each woken separately about new log entries.
+    ProfiledMutex subscribers_mutex;
+    std::vector<Wakeup*> subscribers;
+    // Connections whose clients still exist, reserved by the acceptors
+    // before a client is made, and the ones checked for idleness or
+    // eviction if there is an idle timeout or a connection limit, in
+    // the order they were accepted in.
+    std::atomic<uint32_t> open_connections{0};
+    ProfiledMutex clients_mutex;
+    std::vector<std::weak_ptr<Client>> clients;
 
     Server(ServerOptions &options) 
-    : options(options),
-      random(options.seed) {}
+    : log(std::make_shared<GameLog>(options)),
+      options(options),
+      game(this->options) {}
+
+    void subscribe(Wakeup &wakeup) {
+      std::unique_lock lock = profiled_lock(subscribers_mutex);
+      subscribers.push_back(&wakeup);
+    }
+
+    void unsubscribe(Wakeup &wakeup) {
+      std::unique_lock lock = profiled_lock(subscribers_mutex);
+      std::erase(subscribers, &wakeup);
+    }
+
+    // Wakes every sender thread after a new log entry was published.
+    // Each sender has its own notification, so they do not queue up
+    // on a shared mutex to get woken.
+    void publish() {
+      std::unique_lock lock = profiled_lock(subscribers_mutex);
+      for (Wakeup *wakeup : subscribers)
+        wakeup->notify();
+    }
+
+    GameLogPtr current_log(
+      const std::source_location &where = std::source_location::current()
+      ) {
+      std::unique_lock lock = acquire(where);
+      return log;
+    }
+
+    // Locks the server mutex, recording how long it took. With lock
+    // profiling, the time is also recorded for the caller's site.
+    std::unique_lock<ProfiledMutex> acquire(
+      const std::source_location &where = std::source_location::current()
+      ) {
+      auto start = std::chrono::steady_clock::now();
+      std::unique_lock lock = profiled_lock(server_mutex, where);
+      metrics.lock_wait_ns.record((uint64_t) std::chrono::duration_cast<
+        std::chrono::nanoseconds
+      >(std::chrono::steady_clock::now() - start).count());
+      return lock;
+    }
 
     // Function for adding joining players during Lobby state.
-    bool add_player(std::string name, std::string address, uint8_t &id) {
-      std::unique_lock lock(server_mutex);
+    bool add_player(
+      std::string name,
+      std::string address,
+      uint64_t token,
+      const Client *client,
+      uint8_t &id
+      ) {
+      std::unique_lock lock = acquire();
       // If game has already started, ignore join messages.
       if (game_state == GameState::Game)
         return false;
       
-      debug("[Server] player " + name + " joined");
+      debug("[Server] player {} joined", name);
       players[current_id] = Player(name, address);
+      log->players[current_id] = players[current_id];
+      log->tokens[current_id] = token;
+      log->clients[current_id] = client;
       id = current_id;
       current_id++;
+      log->joined.store(current_id, std::memory_order_release);
 
-      // Alert all sender threads.
-      new_players.notify_all();
       // If enough players joined, start game.
       if (current_id == options.players_count) {
         game_state = GameState::Game;
-        current_turn = 0;
-        turns.clear();
         for (uint8_t id = 0; id < options.players_count; id++)
-          scores[id] = 0;
+          game.scores[id] = 0;
+        log->started.store(true, std::memory_order_release);
         // Alert game handler.
         game_start.notify_all();
       }
+      lock.unlock();
+      // Alert all sender threads.
+      publish();
       return true;
     }
 
+    // Generates a session token, never zero.
+    uint64_t new_token() {
+      std::unique_lock lock = acquire();
+      uint64_t token;
+      do {
+        token = token_random();
+      } while (token == 0);
+      return token;
+    }
+
+    // Finds the player of a session in the running game.
+    bool resume_player(uint64_t token, uint8_t &id, GameLog *&game) {
+      std::unique_lock lock = acquire();
+      if (game_state != GameState::Game)
+        return false;
+      for (uint16_t i = 0; i < current_id; i++) {
+        if (log->tokens[i] == token) {
+          id = (uint8_t) i;
+          game = log.get();
+          return true;
+        }
+      }
+      return false;
+    }
+
     // Function for reseting game state and starting new game.
     void end_game() {
-      std::unique_lock lock(server_mutex);
+      std::unique_lock lock = acquire();
       debug("[Server] Game ended");
+      log->scores = game.scores;
+      log->ended.store(true, std::memory_order_release);
+      log = std::make_shared<GameLog>(options);
       game_state = GameState::Lobby;
       iteration++;
       current_id = 0;
       players.clear();
+      lock.unlock();
+      publish();
     }
   };
 
@@ -93,21 +296,167 @@ namespace {
   struct Client {
     TCPConnection conn;
     std::string address;
+    // Protocol asked for by the client, applied from the next game on.
+    std::atomic<ProtocolVersion> requested_version{ProtocolVersion::Classic};
+    Wakeup wakeup;
+    // Set by the receiver when the client asks for a session, or
+    // resumes one in the game `resumed_log` from `resume_turn` on.
+    std::atomic<bool> wants_session{false};
+    std::atomic<uint64_t> session_token{0};
+    std::atomic<uint16_t> resume_turn{0};
+    std::atomic<GameLog*> resumed_log{nullptr};
+    // Set once the client's first Resume was handled.
+    std::atomic<bool> greeted{false};
+    // Set by the receiver when the client asks for state hashes.
+    std::atomic<bool> wants_state_hash{false};
+    // Set while the client is partway through a message, which it
+    // began to send at `message_started`, in steady clock ticks. Zero
+    // until the client sends its first message.
+    std::atomic<bool> in_message{false};
+    std::atomic<std::chrono::steady_clock::rep> message_started{0};
+    std::atomic<bool> dropped{false};
+    std::atomic<uint32_t> &open_connections;
 
-    Client(tcp::socket &&socket, std::string address) 
+    // Takes over the connection's slot in `open_connections`, which the
+    // acceptor reserved.
+    Client(
+      tcp::socket &&socket,
+      std::string address,
+      std::atomic<uint32_t> &open_connections
+      ) 
     : conn(std::move(socket)),
-      address(address) {}
+      address(address),
+      open_connections(open_connections) {}
+
+    // The socket is closed and the slot given back only here, once both
+    // threads are done.
+    ~Client() {
+      open_connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Shuts the connection down, so both of its threads end.
+    // Returns false if it was dropped already.
+    bool drop() {
+      if (dropped.exchange(true))
+        return false;
+      conn.shutdown();
+      wakeup.notify();
+      return true;
+    }
   };
   using ClientPtr = std::shared_ptr<Client>;
 
+  // Waits for the log to change after `seen` was read from the wakeup
+  // counter. Throws once the client was dropped, ending its sender.
+  void wait_for_log(Client &client, uint32_t seen) {
+    if (client.dropped.load(std::memory_order_acquire))
+      throw std::runtime_error("Connection dropped");
+    client.wakeup.counter.wait(seen, std::memory_order_acquire);
+    if (client.dropped.load(std::memory_order_acquire))
+      throw std::runtime_error("Connection dropped");
+  }
+
+  // As wait_for_log, but returns at the deadline at the latest.
+  void wait_for_log_until(
+    Client &client,
+    uint32_t seen,
+    std::chrono::steady_clock::time_point deadline
+    ) {
+    if (client.dropped.load(std::memory_order_acquire))
+      throw std::runtime_error("Connection dropped");
+    client.wakeup.wait_until(seen, deadline);
+    if (client.dropped.load(std::memory_order_acquire))
+      throw std::runtime_error("Connection dropped");
+  }
+
+  // Limits the rate of one client's messages. Messages over the rate
+  // are not dropped, the receiver waits before reading on, so TCP flow
+  // control holds the client back at no cost to the server.
+  class TokenBucket {
+  public:
+    TokenBucket(uint16_t rate)
+    : rate(rate),
+      tokens(rate),
+      last(std::chrono::steady_clock::now()) {}
+
+    void take() {
+      if (rate == 0)
+        return;
+      refill();
+      if (tokens < 1) {
+        std::this_thread::sleep_for(
+          std::chrono::duration<double>((1 - tokens) / rate)
+        );
+        refill();
+      }
+      tokens -= 1;
+    }
+
+  private:
+    double rate, tokens;
+    std::chrono::steady_clock::time_point last;
+
+    void refill() {
+      auto now = std::chrono::steady_clock::now();
+      tokens = std::min(
+        rate,
+        tokens + rate * std::chrono::duration<double>(now - last).count()
+      );
+      last = now;
+    }
+  };
+
+  // Replays the published turns of a game into the state a client
+  // would have after them.
+  void build_snapshot(
+    const Server &server,
+    const GameLog &log,
+    uint32_t published,
+    ServerToClient &out
+    ) {
+    ClientToGUI state;
+    state.blocks.resize(server.options.size_x, server.options.size_y);
+    state.explosion_radius = server.options.explosion_radius;
+    state.bomb_timer = server.options.bomb_timer;
+    state.player_positions.fill(std::nullopt);
+    state.scores.fill(0);
+    for (uint32_t turn = 0; turn < published; turn++) {
+      state.explosions.clear();
+      state.apply_turn((uint16_t) turn, log.turns[turn]);
+    }
+
+    out.type = ServerToClientType::Snapshot;
+    out.turn = (uint16_t) (published - 1);
+    out.player_positions.clear();
+    for (size_t id = 0; id < state.player_positions.size(); id++) {
+      if (state.player_positions[id])
+        out.player_positions[(Player::PlayerId) id] = *state.player_positions[id];
+    }
+    out.blocks.clear();
+    state.blocks.for_each([&](uint16_t x, uint16_t y) {
+      out.blocks.emplace_back(x, y);
+    });
+    out.bombs = state.bombs;
+    out.explosions = state.explosions;
+    out.scores.clear();
+    uint16_t joined = log.joined.load(std::memory_order_acquire);
+    for (uint16_t id = 0; id < joined; id++)
+      out.scores[(Player::PlayerId) id] = state.scores[id];
+  }
+
   // Function for sending all messages to the client.
   void send_to_client(Server &server, ClientPtr client) {
+    Codec codec;
+    InterestFilter interest;
+    server.subscribe(client->wakeup);
+    bool first_game = true;
     try {
       for (;;) {
         Buffer serialized;
         ServerToClient out;
-        uint8_t current_id = 0;
-        uint16_t current_turn = 0;
+        uint16_t current_id = 0;
+        uint32_t current_turn = 0;
+        uint32_t seen;
 
         // Send hello message.
         out.type = ServerToClientType::Hello;
@@ -118,68 +467,188 @@ namespace {
         out.game_length = server.options.game_length;
         out.explosion_radius = server.options.explosion_radius;
         out.bomb_timer = server.options.bomb_timer;
-        out.serialize(serialized);
+        out.serialize(serialized, codec);
         client->conn.write(serialized);
+        debug("Sent hello message to client {}", client->address);
 
-        // Locking mutex for access to the player map.
-        std::unique_lock lock(server.server_mutex);
-        debug("Sent hello message to client " + client->address);
-        while (server.game_state == Server::GameState::Lobby) {
-          // Wait for new players.
-          server.new_players.wait(
-            lock,
-            [&]{return server.current_id != current_id;}
-          );
-          // Send new accepted player messages.
-          for (; current_id < server.current_id; current_id++) {
-            out.type = ServerToClientType::AcceptedPlayer;
-            out.player_id = current_id;
-            out.player = server.players[current_id];
-            out.serialize(serialized);
-            client->conn.write(serialized);
-            debug("Sent accepted player message to client " + client->address);
+        // Everything below is read from the game's log, without locking.
+        // The wakeup counter is read before the log, so any entry
+        // published later is noticed by the wait.
+        GameLogPtr log = server.current_log();
+        bool started = log->started.load(std::memory_order_acquire);
+        // A client reconnecting during a game may resume its session.
+        // The sender waits a while for its Resume, checking it when
+        // woken and at the deadline.
+        // Resuming is not supported with interest management, as the
+        // filter would have to know what the client remembers.
+        bool resumed = false;
+        if (first_game && started && server.options.interest_radius == 0) {
+          auto deadline = std::chrono::steady_clock::now() + RESUME_GRACE;
+          for (;;) {
+            seen = client->wakeup.counter.load(std::memory_order_acquire);
+            if (client->greeted.load(std::memory_order_acquire) ||
+                log->ended.load(std::memory_order_acquire) ||
+                std::chrono::steady_clock::now() >= deadline)
+              break;
+            wait_for_log_until(*client, seen, deadline);
           }
+          resumed =
+            client->resumed_log.load(std::memory_order_acquire) == log.get();
         }
-        // Sending game started.
-        out.type = ServerToClientType::GameStarted;
-        out.players = server.players;
-        out.serialize(serialized);
-        client->conn.write(serialized);
+        first_game = false;
+        bool filtered = false;
 
-        while (server.game_state == Server::GameState::Game) {
-          // Wait for the next turn.
-          server.new_turn.wait(
-            lock,
-            [&]{return server.current_turn != current_turn;}
+        if (resumed) {
+          ProtocolVersion requested = client->requested_version;
+          if (requested != codec.version) {
+            out.type = ServerToClientType::ProtocolAccepted;
+            out.version = requested;
+            out.serialize(serialized, codec);
+          }
+          out.type = ServerToClientType::Session;
+          out.token = client->session_token;
+          out.serialize(serialized, codec);
+          // Clients that missed many turns get the state of the board
+          // instead of all the turns.
+          uint32_t published =
+            log->published_turns.load(std::memory_order_acquire);
+          current_turn = std::min<uint32_t>(client->resume_turn, published);
+          if (published - current_turn > server.options.max_write_batch) {
+            build_snapshot(server, *log, published, out);
+            out.serialize(serialized, codec);
+            current_turn = published;
+          }
+          client->conn.write(serialized);
+          debug(
+            "Resumed session of client {} from turn {}",
+            client->address,
+            current_turn
           );
-          // Send turn messages.
-          for (; current_turn < server.current_turn; current_turn++) {
-            out.type = ServerToClientType::Turn;
-            out.turn = current_turn;
-            out.events = server.turns[current_turn];
-            out.serialize(serialized);
+        }
+        else {
+          while (!started) {
+            seen = client->wakeup.counter.load(std::memory_order_acquire);
+            // Players join before the game starts, so once the start is
+            // seen, all players are seen as well.
+            started = log->started.load(std::memory_order_acquire);
+            uint16_t joined = log->joined.load(std::memory_order_acquire);
+            // Send new accepted player messages.
+            for (; current_id < joined; current_id++) {
+              out.type = ServerToClientType::AcceptedPlayer;
+              out.player_id = (Player::PlayerId) current_id;
+              out.player = log->players[current_id];
+              out.serialize(serialized, codec);
+              client->conn.write(serialized);
+              debug(
+                "Sent accepted player message to client {}",
+                client->address
+              );
+            }
+            // Wait for new players.
+            if (!started)
+              wait_for_log(*client, seen);
+          }
+          // Switch to the protocol negotiated by the client, if it changed.
+          ProtocolVersion requested = client->requested_version;
+          if (requested != codec.version) {
+            out.type = ServerToClientType::ProtocolAccepted;
+            out.version = requested;
+            out.serialize(serialized, codec);
+          }
+          // Sending game started, in the same write as the protocol switch.
+          out.type = ServerToClientType::GameStarted;
+          out.players.clear();
+          uint16_t joined = log->joined.load(std::memory_order_acquire);
+          for (uint16_t id = 0; id < joined; id++)
+            out.players[(Player::PlayerId) id] = log->players[id];
+          out.serialize(serialized, codec);
+          // Players who asked for a session get its token.
+          uint64_t token = client->session_token;
+          if (token != 0 && std::find(
+                log->tokens.begin(),
+                log->tokens.begin() + joined,
+                token
+              ) != log->tokens.begin() + joined) {
+            out.type = ServerToClientType::Session;
+            out.token = token;
+            out.serialize(serialized, codec);
+          }
+          client->conn.write(serialized);
+
+          // With interest management, players of this game only get
+          // events near their robot.
+          if (server.options.interest_radius > 0) {
+            for (uint16_t id = 0; id < joined; id++) {
+              if (log->clients[id] == client.get()) {
+                interest.reset((Player::PlayerId) id, *log->interest);
+                filtered = true;
+              }
+            }
+          }
+        }
+
+        for (;;) {
+          seen = client->wakeup.counter.load(std::memory_order_acquire);
+          // The game ends only after its last turn is published.
+          bool ended = log->ended.load(std::memory_order_acquire);
+          uint32_t published =
+            log->published_turns.load(std::memory_order_acquire);
+          server.metrics.client_lag_turns.record(published - current_turn);
+          // Send turn messages. A lagging client gets all pending turns
+          // coalesced into writes of up to max_write_batch turns.
+          while (current_turn < published) {
+            uint32_t batch_end = std::min(
+              published,
+              current_turn + server.options.max_write_batch
+            );
+            for (; current_turn < batch_end; current_turn++) {
+              out.type = ServerToClientType::Turn;
+              out.turn = (uint16_t) current_turn;
+              if (filtered)
+                interest.filter(
+                  (uint16_t) current_turn,
+                  log->turns[current_turn],
+                  out.events
+                );
+              else
+                out.events = log->turns[current_turn];
+              out.serialize(serialized, codec);
+              // Filtered clients do not see the whole board.
+              if (!filtered && client->wants_state_hash) {
+                out.type = ServerToClientType::StateHash;
+                out.state_hash = log->hashes[current_turn];
+                out.serialize(serialized, codec);
+              }
+            }
+            server.metrics.write_bytes.record(serialized.data.size());
+            server.metrics.sent_bytes.add(serialized.data.size());
             client->conn.write(serialized);
             debug(
-              "Sent turn " + std::to_string(current_turn) +
-              " to client " + client->address
+              "Sent turns up to {} to client {}",
+              current_turn - 1,
+              client->address
             );
           }
+          if (ended)
+            break;
+          // Wait for the next turn.
+          wait_for_log(*client, seen);
         }
         //Sending game ended.
         out.type = ServerToClientType::GameEnded;
-        out.scores = server.scores;
-        out.serialize(serialized);
+        out.scores = log->scores;
+        out.serialize(serialized, codec);
         client->conn.write(serialized);
-        debug("Sent game ended to client " + client->address);
+        debug("Sent game ended to client {}", client->address);
       }
     }
     catch (std::exception &e) {
-      try {
-        client->conn.close();
-        debug("Closing connection with " + client->address);
+      if (client->drop()) {
+        server.metrics.disconnections.add();
+        debug("Closing connection with {}", client->address);
       }
-      catch (std::exception &e) {}
     }
+    server.unsubscribe(client->wakeup);
   }
 
   // Function listening for messages from the client.
@@ -187,11 +656,21 @@ namespace {
     uint32_t current_iteration = 0;
     bool joined = false;
     uint8_t id = 0;
+    TokenBucket input_limit(server.options.max_input_rate);
     try {
       for (;;) {
-        ClientToServer in(client->conn);
+        uint8_t type;
+        client->conn.read8(type);
+        client->message_started.store(
+          std::chrono::steady_clock::now().time_since_epoch().count(),
+          std::memory_order_relaxed
+        );
+        client->in_message.store(true, std::memory_order_release);
+        ClientToServer in(client->conn, type);
+        client->in_message.store(false, std::memory_order_relaxed);
+        input_limit.take();
         {
-          std::unique_lock lock(server.server_mutex);
+          std::unique_lock lock = server.acquire();
           // If a new game has begun, reset join status.
           if (server.iteration > current_iteration) {
             joined = false;
@@ -200,49 +679,217 @@ namespace {
         }
         switch (in.type) {
           case ClientToServerType::Join:
+            {
             if (joined)
               break;
-            if (server.add_player(in.name, client->address, id))
+            uint64_t token = 0;
+            if (client->wants_session) {
+              token = server.new_token();
+              client->session_token = token;
+            }
+            if (server.add_player(
+                  in.name, client->address, token, client.get(), id
+                ))
               joined = true;
             break;
+            }
+          case ClientToServerType::Resume:
+            {
+            client->wants_session = true;
+            GameLog *game;
+            if (in.token != 0 && !joined &&
+                server.resume_player(in.token, id, game)) {
+              joined = true;
+              client->session_token = in.token;
+              client->resume_turn = in.turn;
+              client->resumed_log.store(game, std::memory_order_release);
+            }
+            client->greeted.store(true, std::memory_order_release);
+            client->wakeup.notify();
+            break;
+            }
+          case ClientToServerType::Negotiate:
+            client->requested_version = in.version;
+            break;
+          case ClientToServerType::VerifyState:
+            client->wants_state_hash = true;
+            break;
           default:
             if (!joined)
               break;
-            std::unique_lock lock(server.moves_mutex);
-            server.player_moves[id] = in;
+            server.game.inputs[id].action.store(
+              pack_input(in),
+              std::memory_order_relaxed
+            );
             break;
         }
       }
     }
     catch (std::exception &e) {
-      try {
-        client->conn.close();
-        debug("Closing connection with " + client->address);
+      if (client->drop()) {
+        server.metrics.disconnections.add();
+        debug("Closing connection with {}", client->address);
+      }
+    }
+  }
+
+  // Drops connections that started a message and did not finish it
+  // within the idle timeout, like ones trickling a message in too
+  // slowly. Connections between messages are kept however long they
+  // stay quiet: spectators never send anything and players may not
+  // move for a while. Checked a few times per timeout, so connections
+  // are dropped a bit late at most.
+  void reap_idle_connections(Server &server) {
+    auto timeout = std::chrono::milliseconds(server.options.idle_timeout);
+    for (;;) {
+      std::this_thread::sleep_for(timeout / 4);
+      auto oldest = (std::chrono::steady_clock::now() - timeout)
+        .time_since_epoch().count();
+      std::vector<ClientPtr> idle;
+      {
+        std::unique_lock lock = profiled_lock(server.clients_mutex);
+        std::erase_if(server.clients, [](const std::weak_ptr<Client> &client) {
+          return client.expired();
+        });
+        for (const std::weak_ptr<Client> &weak : server.clients) {
+          ClientPtr client = weak.lock();
+          if (client &&
+              client->in_message.load(std::memory_order_acquire) &&
+              client->message_started.load(std::memory_order_relaxed) < oldest)
+            idle.push_back(client);
+        }
+      }
+      for (const ClientPtr &client : idle) {
+        if (client->drop()) {
+          server.metrics.idle_disconnections.add();
+          debug("Dropping stalled connection with {}", client->address);
+        }
       }
-      catch (std::exception &e) {}
     }
   }
 
-  void accept_new_connections(Server &server) {
-    tcp::acceptor acceptor(
-      server.io_context,
-      tcp::endpoint(tcp::v6(), server.options.port)
-    );
+  // Makes room for a new connection at the connection limit by dropping
+  // the oldest one that has not sent a single message, like a scanner
+  // or a client that never got past connecting. Returns false if every
+  // connection has sent something.
+  bool evict_unheard_connection(Server &server) {
+    for (;;) {
+      ClientPtr oldest;
+      {
+        std::unique_lock lock = profiled_lock(server.clients_mutex);
+        for (const std::weak_ptr<Client> &weak : server.clients) {
+          ClientPtr client = weak.lock();
+          if (client &&
+              !client->dropped.load(std::memory_order_acquire) &&
+              client->message_started.load(std::memory_order_relaxed) == 0) {
+            oldest = std::move(client);
+            break;
+          }
+        }
+      }
+      if (!oldest)
+        return false;
+      // Another acceptor may have dropped it meanwhile, look again.
+      if (oldest->drop()) {
+        server.metrics.evicted_connections.add();
+        debug("[Acceptor] Evicted connection with {}", oldest->address);
+        return true;
+      }
+    }
+  }
+
+  // Lets the kernel close connections to peers that went away without
+  // a word, which would otherwise stay quiet forever: probes start after
+  // the idle timeout and a peer that does not answer them, or does not
+  // acknowledge sent data, for as long is dropped.
+  void set_keepalive(tcp::socket &socket, uint32_t idle_timeout) {
+    using keep_idle =
+      boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>;
+    using keep_interval =
+      boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL>;
+    using user_timeout =
+      boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_USER_TIMEOUT>;
+    int seconds = std::max<int>(1, (int) (idle_timeout / 1000));
+    socket.set_option(tcp::socket::keep_alive(true));
+    socket.set_option(keep_idle(seconds));
+    socket.set_option(keep_interval(seconds));
+    socket.set_option(user_timeout((int) idle_timeout));
+  }
+
+  // Formats an endpoint like writing it to a stream does, without
+  // the cost of setting up a stream.
+  std::string format_endpoint(const tcp::endpoint &endpoint) {
+    std::string port = std::to_string(endpoint.port());
+    if (endpoint.address().is_v4())
+      return endpoint.address().to_string() + ":" + port;
+    return "[" + endpoint.address().to_string() + "]:" + port;
+  }
+
+  // Opens one of the server's listening sockets. With more acceptors,
+  // each has a socket of its own on the same port and the kernel
+  // spreads new connections between them.
+  tcp::acceptor open_acceptor(Server &server) {
+    using reuse_port =
+      boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    tcp::endpoint endpoint(tcp::v6(), server.options.port);
+    tcp::acceptor acceptor(server.io_context);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if (server.options.acceptors > 1)
+      acceptor.set_option(reuse_port(true));
+    acceptor.bind(endpoint);
+    acceptor.listen(tcp::socket::max_listen_connections);
+    return acceptor;
+  }
+
+  void accept_new_connections(Server &server, tcp::acceptor &acceptor) {
     for (;;) {
       try {
         tcp::socket socket(server.io_context);
-        acceptor.accept(socket);
+        tcp::endpoint endpoint;
+        acceptor.accept(socket, endpoint);
         socket.set_option(tcp::no_delay(true));
-        std::ostringstream client_address;
-        client_address << socket.remote_endpoint();
+        if (server.options.idle_timeout != 0)
+          set_keepalive(socket, server.options.idle_timeout);
+        // The slot is reserved before anything else is done, so that
+        // acceptors racing each other can not go over the limit. At the
+        // limit an unheard connection makes room, otherwise the new one
+        // is closed right away, which keeps the threads and memory taken
+        // by connections bounded. Evicted connections give their slots
+        // back once their threads notice.
+        uint32_t open =
+          server.open_connections.fetch_add(1, std::memory_order_relaxed);
+        if (server.options.max_connections != 0 &&
+            open >= server.options.max_connections &&
+            !evict_unheard_connection(server)) {
+          server.open_connections.fetch_sub(1, std::memory_order_relaxed);
+          server.metrics.rejected_connections.add();
+          debug("[Acceptor] Too many connections, rejected one");
+          continue;
+        }
         ClientPtr client = std::make_shared<Client>(
           std::move(socket),
-          client_address.str()
+          format_endpoint(endpoint),
+          server.open_connections
         );
+        if (server.options.idle_timeout != 0 ||
+            server.options.max_connections != 0) {
+          std::unique_lock lock = profiled_lock(server.clients_mutex);
+          // Without the reaper pruning them, closed connections are
+          // pruned here once they outnumber the open ones.
+          if (server.clients.size() >
+                2 * (size_t) server.open_connections.load(
+                  std::memory_order_relaxed))
+            std::erase_if(server.clients, [](const std::weak_ptr<Client> &c) {
+              return c.expired();
+            });
+          server.clients.push_back(client);
+        }
 
+        server.metrics.connections.add();
         debug(
-          "[Acceptor] Accepted connection from client " +
-          client_address.str()
+          "[Acceptor] Accepted connection from client {}",
+          client->address
         );
         // Start both client threads.
         std::thread sender(
@@ -265,226 +912,133 @@ namespace {
     }
   }
 
-  // Helper function for processing bomb explosions.
-  void process_bombs(
-    Server &server, 
-    std::vector<Event> &current_events,
-    std::set<Player::PlayerId> &robots_destroyed
-    ) {
-    static std::vector<std::pair<int32_t,int32_t>> sides = {
-      {1,0}, {0,1}, {-1, 0}, {0, -1}
-    };
-    std::set<Position> blocks_destroyed;
-    std::set<Bomb::BombId> bombs_exploded;
-    for (auto &[bomb_id, bomb] : server.bombs) {
-      bomb.timer--;
-      if (bomb.timer == 0) {
-        Event event;
-        event.type = EventType::BombExploded;
-        event.bomb_id = bomb_id;
-
-        for (const std::pair<int32_t, int32_t> &side : sides) {
-          Position position = bomb.position;
-          int32_t x = position.x, y = position.y;
-          for (uint16_t i = 0; i <= server.options.explosion_radius; i++) {
-            position = Position((uint16_t) x, (uint16_t) y);
-            // Check if any robots were destroyed.
-            for (const auto &[id, p] : server.player_positions) {
-              if (position.x == p.x && position.y == p.y) {
-                robots_destroyed.insert(id);
-                if (i > 0 || side == sides[0])
-                  event.robots_destroyed.push_back(id);
-              }
-            }
-            // If the explosion reaches a block, it stops.
-            if (server.blocks.contains(position)) {
-              blocks_destroyed.insert(position);
-              if (i > 0 || side == sides[0])
-                event.blocks_destroyed.push_back(position);
-              break;
-            }
-            x += side.first;
-            y += side.second;
-            if (x == -1 || x == server.options.size_x || 
-                y == -1 || y == server.options.size_y)
-              break;
-          }
-        }
-        current_events.push_back(event);
-        bombs_exploded.insert(bomb_id);
-      }
+  // Serves the metrics in plain text to every connection
+  // made to the stats port on the loopback interface.
+  void serve_stats(Server &server) {
+    // Metrics are optional, the game goes on without them.
+    tcp::acceptor acceptor(server.io_context);
+    try {
+      tcp::endpoint endpoint(
+        boost::asio::ip::address_v4::loopback(), 
+        server.options.stats_port
+      );
+      acceptor.open(endpoint.protocol());
+      acceptor.set_option(tcp::acceptor::reuse_address(true));
+      acceptor.bind(endpoint);
+      acceptor.listen();
     }
-    for (const Position &position : blocks_destroyed)
-      server.blocks.erase(position);
-    for (const Bomb::BombId &bomb_id : bombs_exploded)
-      server.bombs.erase(bomb_id);
-  }
-
-  // Helper function for processing one turn.
-  void process_turn(Server &server, std::vector<Event> &current_events) {
-    std::set<Player::PlayerId> robots_destroyed;
-    
-    process_bombs(server, current_events, robots_destroyed);
-
-    Event event;
-    for (uint8_t id = 0; id < server.options.players_count; id++) {
-      // Ignore destroyed robots' moves.
-      if (robots_destroyed.contains(id)) {
-        event.type = EventType::PlayerMoved;
-        event.player_id = id;
-        uint16_t x = uint16_t(server.random() % server.options.size_x),
-                 y = uint16_t(server.random() % server.options.size_y);
-        event.position = Position(x, y);
-        server.player_positions[id] = event.position;
-        current_events.push_back(event);
-        server.scores[id]++;
+    catch (std::exception &e) {
+      Logger::log(
+        LogLevel::Error,
+        "[Server] Unable to serve stats on port {}: {}",
+        server.options.stats_port, e.what()
+      );
+      return;
+    }
+    for (;;) {
+      try {
+        tcp::socket socket(server.io_context);
+        acceptor.accept(socket);
+        std::string text = server.metrics.dump();
+        boost::asio::write(socket, boost::asio::buffer(text));
+        socket.close();
       }
-      else {
-        std::unique_lock moves_lock(server.moves_mutex);
-        if (!server.player_moves.contains(id))
-          continue;
-        ClientToServer move = server.player_moves[id];
-        moves_lock.unlock();
-
-        switch (move.type) {
-          case ClientToServerType::PlaceBomb:
-            event.type = EventType::BombPlaced;
-            event.bomb_id = server.current_bomb;
-            event.position = server.player_positions[id];
-            server.bombs[server.current_bomb] = Bomb(
-              event.position, 
-              server.options.bomb_timer
-            );
-            server.current_bomb++;
-            current_events.push_back(event);
-            break;
-          case ClientToServerType::PlaceBlock:
-            if (!server.blocks.contains(server.player_positions[id])) {
-              event.type = EventType::BlockPlaced;
-              event.position = server.player_positions[id];
-              server.blocks.insert(server.player_positions[id]);
-              current_events.push_back(event);
-            }
-            break;
-          case ClientToServerType::Move:
-            {
-            event.type = EventType::PlayerMoved;
-            event.player_id = id;
-            event.position = server.player_positions[id];
-            uint16_t x = event.position.x, y = event.position.y;
-            switch (move.direction) {
-              case Direction::Up:
-                if (y + 1 < server.options.size_y)
-                  event.position = Position(x, (uint16_t) (y + 1));
-                break;
-              case Direction::Right:
-                if (x + 1 < server.options.size_x)
-                  event.position = Position((uint16_t) (x + 1), y);
-                break;
-              case Direction::Down:
-                if (y - 1 >= 0)
-                  event.position = Position(x, (uint16_t) (y - 1));
-                break;
-              case Direction::Left:
-                if (x - 1 >= 0)
-                  event.position = Position((uint16_t) (x - 1), y);
-                break;
-            }
-            if (server.blocks.contains(event.position))
-              break;
-            if (event.position.x != x || event.position.y != y) {
-              server.player_positions[id] = event.position;
-              current_events.push_back(event);
-            }
-            break;
-            }
-          default:
-            throw std::runtime_error("Something went wrong");
-        } 
+      catch (std::exception &e) {
+        continue;
       }
     }
   }
 
   // Handles game logic.
   void handle_game(Server &server) {
+    std::vector<std::byte> turn_memory(Game::TURN_ARENA);
     for (;;) {
-      server.player_positions.clear();
-      server.blocks.clear();
-      server.bombs.clear();
-      server.current_bomb = 0;
       std::vector<Event> current_events;
+      GameLogPtr log;
+      AllocationBudget turn_allocations("Game turn", 0, 16);
 
       {
         // Wait for the start of the game.
-        std::unique_lock lock(server.server_mutex);
+        std::unique_lock lock = server.acquire();
         server.game_start.wait(
           lock,
           [&]{return server.game_state == Server::GameState::Game;}
         );
+        log = server.log;
       }
 
       // Prepare the first turn message.
-      for (uint8_t id = 0; id < server.options.players_count; id++) {
-        Event event;
-        event.type = EventType::PlayerMoved;
-        event.player_id = id;
-        uint16_t x = uint16_t(server.random() % server.options.size_x),
-                 y = uint16_t(server.random() % server.options.size_y);
-        event.position = Position(x, y);
-        server.player_positions[id] = event.position;
-        current_events.push_back(event);
-      }
-      for (uint16_t i = 0; i < server.options.initial_blocks; i++) {
-        Event event;
-        event.type = EventType::BlockPlaced;
-        uint16_t x = uint16_t(server.random() % server.options.size_x),
-                 y = uint16_t(server.random() % server.options.size_y);
-        event.position = Position(x, y);
-        // Check if there was already a block at this position.
-        if (server.blocks.insert(event.position).second)
-          current_events.push_back(event);
-      }
-      
+      server.game.start(current_events);
+
       for (uint16_t turn = 0; turn <= server.options.game_length; turn++) {
-        {
-          std::unique_lock lock(server.server_mutex);
-          server.current_turn++;
-          server.turns.push_back(current_events);
-          current_events.clear();
-          debug("[Game Handler] Processed turn " + std::to_string(turn));
-        }
+        log->turns[turn] = std::move(current_events);
+        current_events.clear();
+        // The turns are kept in the log, the next one gets room for all
+        // of its events before it is processed.
+        current_events.reserve(server.game.max_turn_events());
+        log->hashes[turn] = server.game.hash();
+        if (log->interest)
+          log->interest->add_turn(turn, log->turns[turn]);
+        log->published_turns.store(turn + 1, std::memory_order_release);
+        server.publish();
+        debug("[Game Handler] Processed turn {}", turn);
 
-        {
-          std::unique_lock moves_lock(server.moves_mutex);
-          server.player_moves.clear();
-        }
+        // Discard actions that arrived while the turn was processed.
+        server.game.discard_inputs();
 
-        server.new_turn.notify_all();
         if (turn == server.options.game_length)
           break;
         std::this_thread::sleep_for(std::chrono::milliseconds(
           server.options.turn_duration
         ));
 
-        process_turn(server, current_events);
+        {
+          ScopedTimer timer(server.metrics.turn_duration_us);
+          AllocationBudget::Run allocations(turn_allocations);
+          std::pmr::monotonic_buffer_resource arena(
+            turn_memory.data(), turn_memory.size()
+          );
+          server.game.process_turn(current_events, arena);
+          allocations.allow(Game::allocations(current_events));
+#ifdef ALLOC_CHECK
+          server.metrics.turn_allocations.record(allocations.count());
+#endif
+        }
+        server.metrics.turns.add();
       }
       server.end_game();
-      server.new_turn.notify_all();
     }
   }
 } // anonymous namespace
 
 int main(int argc, char *argv[]) {
+  // Before the logger or any other thread starts.
+  dump_lock_profile_on_signal();
   try {
     ServerOptions options = ServerOptions(argc, argv);
-    debug(
-      "[Server] Listening for clients on port " +
-      std::to_string(options.port)
-    );
+    Logger::set_level(options.log_level);
+    if (set_io_backend(options.io_backend) != options.io_backend)
+      info("[Server] io_uring is not available, using asio");
+    debug("[Server] Listening for clients on port {}", options.port);
     Server server(options);
+    std::vector<tcp::acceptor> acceptors;
+    for (uint16_t i = 0; i < options.acceptors; i++)
+      acceptors.push_back(open_acceptor(server));
     std::thread game_handler(handle_game, std::ref(server));
-    std::thread acceptor(accept_new_connections, std::ref(server));
-    acceptor.join();
+    std::vector<std::thread> acceptor_threads;
+    for (tcp::acceptor &acceptor : acceptors) {
+      acceptor_threads.emplace_back(
+        accept_new_connections,
+        std::ref(server),
+        std::ref(acceptor)
+      );
+    }
+    if (options.stats_port != 0)
+      std::thread(serve_stats, std::ref(server)).detach();
+    if (options.idle_timeout != 0)
+      std::thread(reap_idle_connections, std::ref(server)).detach();
+    for (std::thread &acceptor : acceptor_threads)
+      acceptor.join();
     game_handler.join();
   }
   catch (std::exception &e) {
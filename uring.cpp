@@ -0,0 +1,451 @@
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.hpp"
+
+namespace {
+  // Mark requests other than the ones data is waited for with.
+  constexpr uint64_t PROVIDE_TAG = 1;
+  constexpr uint64_t CANCEL_TAG = 2;
+  constexpr uint64_t NOP_TAG = 3;
+  constexpr uint64_t WAKE_TAG = 4;
+  constexpr uint16_t BUFFER_GROUP = 0;
+
+  unsigned load_acquire(unsigned *value) {
+    return std::atomic_ref<unsigned>(*value).load(std::memory_order_acquire);
+  }
+
+  void store_release(unsigned *value, unsigned number) {
+    std::atomic_ref<unsigned>(*value).store(number, std::memory_order_release);
+  }
+
+  [[noreturn]] void throw_errno(int error, const char *what) {
+    throw std::system_error(error, std::system_category(), what);
+  }
+
+  template<typename T>
+  T *at(void *ring, uint32_t offset) {
+    return (T *) ((char *) ring + offset);
+  }
+
+  // Receives a datagram the way UringDatagram does, with a multishot
+  // request armed before the datagram is sent. Kernels that know the
+  // operations but not the flags fail the request with EINVAL.
+  bool receives_multishot(IoUring &ring) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sockets) < 0)
+      return false;
+    // Outlives the ring's requests, the ring is closed first.
+    static uint8_t buffer[1];
+    io_uring_sqe &provide = ring.prepare(IORING_OP_PROVIDE_BUFFERS, 1);
+    provide.addr = (uint64_t) buffer;
+    provide.len = sizeof(buffer);
+    provide.buf_group = BUFFER_GROUP;
+    provide.flags = IOSQE_CQE_SKIP_SUCCESS;
+    provide.user_data = PROVIDE_TAG;
+    io_uring_sqe &recv = ring.prepare(IORING_OP_RECV, sockets[0]);
+    recv.ioprio = IORING_RECV_MULTISHOT;
+    recv.flags = IOSQE_BUFFER_SELECT;
+    recv.buf_group = BUFFER_GROUP;
+    // Submits both requests before the datagram is there.
+    io_uring_sqe &nop = ring.prepare(IORING_OP_NOP, -1);
+    nop.user_data = NOP_TAG;
+    bool received = false;
+    if (ring.wait().user_data == NOP_TAG &&
+        ::send(sockets[1], "", 1, 0) == 1) {
+      io_uring_cqe cqe = ring.wait();
+      received = cqe.user_data == 0 && cqe.res == 1 &&
+        (cqe.flags & IORING_CQE_F_BUFFER);
+    }
+    ::close(sockets[0]);
+    ::close(sockets[1]);
+    return received;
+  }
+
+  // Sends the data of every stream through one ring, from a thread of
+  // its own. Streams queue their sends and wake the thread only if it
+  // waits in the kernel, so sends queued together, like the ones of a
+  // turn to many clients, are submitted by a single system call.
+  class UringSender {
+  public:
+    static UringSender &instance() {
+      // Never destroyed, its thread runs until the process exits.
+      static UringSender &sender = *new UringSender();
+      return sender;
+    }
+
+    void send(UringSend &send) {
+      bool wake;
+      {
+        std::lock_guard lock(mutex);
+        queue.push_back(&send);
+        wake = sleeping;
+        sleeping = false;
+      }
+      uint64_t one = 1;
+      if (wake && ::write(wake_fd, &one, sizeof(one)) < 0)
+        throw_errno(errno, "eventfd write");
+    }
+
+  private:
+    static constexpr unsigned ENTRIES = 256;
+    IoUring ring{ENTRIES};
+    int wake_fd;
+    std::mutex mutex;
+    std::vector<UringSend*> queue, taken;
+    bool sleeping{false};
+
+    UringSender()
+    : wake_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+      if (wake_fd < 0)
+        throw_errno(errno, "eventfd");
+      arm();
+      std::thread([this]{ run(); }).detach();
+    }
+
+    void arm() {
+      io_uring_sqe &sqe = ring.prepare(IORING_OP_POLL_ADD, wake_fd);
+      sqe.poll32_events = POLLIN;
+      sqe.user_data = WAKE_TAG;
+    }
+
+    void submit(UringSend &send) {
+      io_uring_sqe &sqe = ring.prepare(IORING_OP_SEND, send.fd);
+      sqe.addr = (uint64_t) (send.data.data() + send.sent);
+      sqe.len = (uint32_t) std::min<size_t>(
+        send.data.size() - send.sent, UINT32_MAX
+      );
+      sqe.msg_flags = MSG_NOSIGNAL;
+      sqe.user_data = (uint64_t) &send;
+    }
+
+    void complete(const io_uring_cqe &cqe) {
+      if (cqe.user_data == WAKE_TAG) {
+        uint64_t count;
+        if (::read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          throw_errno(errno, "eventfd read");
+        arm();
+        return;
+      }
+      UringSend &send = *(UringSend *) cqe.user_data;
+      if (cqe.res < 0)
+        send.error = -cqe.res;
+      else {
+        send.sent += (size_t) cqe.res;
+        if (send.sent < send.data.size()) {
+          submit(send);
+          return;
+        }
+      }
+      send.in_flight.store(false, std::memory_order_release);
+      send.in_flight.notify_one();
+    }
+
+    void run() {
+      for (;;) {
+        {
+          std::lock_guard lock(mutex);
+          taken.swap(queue);
+          // Sends queued from now on wake the thread.
+          sleeping = true;
+        }
+        for (UringSend *send : taken)
+          submit(*send);
+        taken.clear();
+        io_uring_cqe cqe = ring.wait();
+        do {
+          complete(cqe);
+        } while (ring.pop(cqe));
+      }
+    }
+  };
+} // anonymous namespace
+
+IoUring::IoUring(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    throw_errno(errno, "io_uring_setup");
+  features = params.features;
+  sq_entries = params.sq_entries;
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  // Both rings usually share one mapping.
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  sq_ring = mmap(
+    nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING
+  );
+  cq_ring = single ? sq_ring : mmap(
+    nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING
+  );
+  sqes = (io_uring_sqe *) mmap(
+    nullptr, params.sq_entries * sizeof(io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES
+  );
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    int error = errno;
+    ::close(fd);
+    throw_errno(error, "io_uring mmap");
+  }
+  sq_head = at<unsigned>(sq_ring, params.sq_off.head);
+  sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+  sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+  sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+  cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+  cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+  cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+  cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+  munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+  if (cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  ::close(fd);
+}
+
+bool IoUring::supported() {
+  static const bool result = []{
+    try {
+      IoUring ring(4);
+      constexpr unsigned OPS = IORING_OP_LAST;
+      auto probe = std::make_unique<uint8_t[]>(
+        sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op)
+      );
+      memset(
+        probe.get(), 0,
+        sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op)
+      );
+      io_uring_probe *ops = (io_uring_probe *) probe.get();
+      if (syscall(
+            __NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, ops, OPS
+          ) < 0)
+        return false;
+      for (uint8_t op : {
+            IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_RECV,
+            IORING_OP_SENDMSG, IORING_OP_PROVIDE_BUFFERS
+          }) {
+        if (op >= ops->ops_len || !(ops->ops[op].flags & IO_URING_OP_SUPPORTED))
+          return false;
+      }
+      // The operations are older than the flags UringDatagram sets.
+      if (!(ring.features & IORING_FEAT_CQE_SKIP))
+        return false;
+      return receives_multishot(ring);
+    }
+    catch (std::exception &e) {
+      return false;
+    }
+  }();
+  return result;
+}
+
+io_uring_sqe &IoUring::prepare(uint8_t opcode, int fd) {
+  unsigned tail = *sq_tail;
+  if (tail - load_acquire(sq_head) == sq_entries)
+    enter(0);
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe &sqe = sqes[index];
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sq_array[index] = index;
+  store_release(sq_tail, tail + 1);
+  pending++;
+  return sqe;
+}
+
+bool IoUring::pop(io_uring_cqe &cqe) {
+  unsigned head = *cq_head;
+  if (head == load_acquire(cq_tail))
+    return false;
+  cqe = cqes[head & *cq_mask];
+  store_release(cq_head, head + 1);
+  return true;
+}
+
+void IoUring::enter(unsigned min_complete) {
+  long submitted = syscall(
+    __NR_io_uring_enter, fd, pending, min_complete,
+    min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0
+  );
+  if (submitted < 0) {
+    if (errno == EINTR)
+      return;
+    throw_errno(errno, "io_uring_enter");
+  }
+  pending -= (unsigned) submitted;
+}
+
+io_uring_cqe IoUring::wait() {
+  io_uring_cqe cqe;
+  while (pending > 0 || !pop(cqe))
+    enter(1);
+  return cqe;
+}
+
+void IoUring::register_buffers(const iovec *buffers, unsigned count) {
+  if (syscall(
+        __NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers, count
+      ) < 0)
+    throw_errno(errno, "io_uring_register");
+}
+
+UringStream::UringStream(int fd)
+: fd(fd),
+  data(std::make_unique<uint8_t[]>(READ_BUFFER)) {
+  iovec buffer{data.get(), READ_BUFFER};
+  reader.register_buffers(&buffer, 1);
+  sending.fd = fd;
+  // Started with the first stream, so that a failure falls back the
+  // same way.
+  UringSender::instance();
+}
+
+UringStream::~UringStream() {
+  sending.in_flight.wait(true, std::memory_order_acquire);
+}
+
+void UringStream::read(void *buffer, size_t size) {
+  uint8_t *out = (uint8_t *) buffer;
+  while (size > 0) {
+    if (begin == end) {
+      io_uring_sqe &sqe = reader.prepare(IORING_OP_READ_FIXED, fd);
+      sqe.addr = (uint64_t) data.get();
+      sqe.len = READ_BUFFER;
+      sqe.buf_index = 0;
+      io_uring_cqe cqe = reader.wait();
+      if (cqe.res < 0)
+        throw_errno(-cqe.res, "read");
+      if (cqe.res == 0)
+        throw std::runtime_error("Connection closed by peer");
+      begin = 0;
+      end = (size_t) cqe.res;
+    }
+    size_t length = std::min(size, end - begin);
+    memcpy(out, data.get() + begin, length);
+    begin += length;
+    out += length;
+    size -= length;
+  }
+}
+
+void UringStream::write(std::vector<uint8_t> &buffer) {
+  sending.in_flight.wait(true, std::memory_order_acquire);
+  if (sending.error != 0)
+    throw_errno(sending.error, "send");
+  if (buffer.empty())
+    return;
+  sending.data.swap(buffer);
+  buffer.clear();
+  sending.sent = 0;
+  sending.in_flight.store(true, std::memory_order_relaxed);
+  UringSender::instance().send(sending);
+}
+
+UringDatagram::UringDatagram(int fd, const sockaddr *peer, socklen_t length)
+: fd(fd),
+  cancel_fd(eventfd(0, EFD_CLOEXEC)),
+  peer_length(length),
+  buffers(std::make_unique<uint8_t[]>(BUFFERS * BUFFER_SIZE)) {
+  if (cancel_fd < 0)
+    throw_errno(errno, "eventfd");
+  memcpy(&this->peer, peer, length);
+  provide(0, BUFFERS);
+  // Receives end once the event is signalled.
+  io_uring_sqe &sqe = receiver.prepare(IORING_OP_POLL_ADD, cancel_fd);
+  sqe.poll32_events = POLLIN;
+  sqe.user_data = CANCEL_TAG;
+}
+
+UringDatagram::~UringDatagram() {
+  ::close(cancel_fd);
+}
+
+void UringDatagram::cancel() {
+  uint64_t one = 1;
+  if (::write(cancel_fd, &one, sizeof(one)) < 0)
+    throw_errno(errno, "eventfd write");
+}
+
+void UringDatagram::provide(uint16_t first, uint16_t count) {
+  io_uring_sqe &sqe = receiver.prepare(IORING_OP_PROVIDE_BUFFERS, count);
+  sqe.addr = (uint64_t) (buffers.get() + first * BUFFER_SIZE);
+  sqe.len = BUFFER_SIZE;
+  sqe.off = first;
+  sqe.buf_group = BUFFER_GROUP;
+  sqe.flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe.user_data = PROVIDE_TAG;
+}
+
+size_t UringDatagram::receive(void *buffer, size_t size) {
+  for (;;) {
+    if (cancelled)
+      throw std::runtime_error("Connection closed");
+    // The request stays armed until the kernel ends it, for example
+    // when it runs out of buffers.
+    if (!armed) {
+      io_uring_sqe &sqe = receiver.prepare(IORING_OP_RECV, fd);
+      sqe.ioprio = IORING_RECV_MULTISHOT;
+      sqe.flags = IOSQE_BUFFER_SELECT;
+      sqe.buf_group = BUFFER_GROUP;
+      armed = true;
+    }
+    io_uring_cqe cqe = receiver.wait();
+    if (cqe.user_data == CANCEL_TAG) {
+      cancelled = true;
+      continue;
+    }
+    if (cqe.user_data == PROVIDE_TAG) {
+      if (cqe.res < 0)
+        throw_errno(-cqe.res, "provide buffers");
+      continue;
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+      armed = false;
+    if (cqe.res == -ENOBUFS)
+      continue;
+    if (cqe.res < 0)
+      throw_errno(-cqe.res, "recv");
+    if (!(cqe.flags & IORING_CQE_F_BUFFER))
+      return 0;
+    uint16_t id = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    size_t length = std::min(size, (size_t) cqe.res);
+    memcpy(buffer, buffers.get() + id * BUFFER_SIZE, length);
+    provide(id, 1);
+    return length;
+  }
+}
+
+void UringDatagram::send(const uint8_t *buffer, size_t size) {
+  iovec data{(void *) buffer, size};
+  msghdr message{};
+  message.msg_name = &peer;
+  message.msg_namelen = peer_length;
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  io_uring_sqe &sqe = sender.prepare(IORING_OP_SENDMSG, fd);
+  sqe.addr = (uint64_t) &message;
+  sqe.len = 1;
+  sqe.msg_flags = MSG_NOSIGNAL;
+  io_uring_cqe cqe = sender.wait();
+  if (cqe.res < 0)
+    throw_errno(-cqe.res, "sendmsg");
+}
@@ -0,0 +1,124 @@
+#ifndef URING_HPP
+#define URING_HPP
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring instance, set up with the raw system calls, so no
+// library is needed. Requests are queued with `prepare` and submitted
+// together by the next `wait`, a single system call for all of them.
+// A ring must only be used by one thread at a time.
+class IoUring {
+public:
+  explicit IoUring(unsigned entries);
+  ~IoUring();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Checks once if the kernel lets the process use io_uring with
+  // every operation and flag the connections need.
+  static bool supported();
+
+  // Queues a request, submitting the queued ones if the ring is full.
+  io_uring_sqe &prepare(uint8_t opcode, int fd);
+
+  // Submits all queued requests and returns the next completion.
+  io_uring_cqe wait();
+
+  // Takes the next completion without waiting, if there is one.
+  bool pop(io_uring_cqe&);
+
+  void register_buffers(const iovec*, unsigned);
+
+private:
+  int fd;
+  unsigned pending{0};
+  unsigned features;
+  unsigned sq_entries;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  io_uring_sqe *sqes;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+  void enter(unsigned min_complete);
+};
+
+// Data a stream hands to the process's sender thread, see uring.cpp.
+struct UringSend {
+  int fd;
+  std::vector<uint8_t> data;
+  size_t sent{0};
+  // Errno of a failed send, later writes fail with it too.
+  int error{0};
+  // Cleared by the sender thread once the data is sent or failed.
+  std::atomic<bool> in_flight{false};
+};
+
+// Stream socket read and written through io_uring. Reads fill a
+// registered buffer and are served from it, so a message of many small
+// fields takes one request instead of a system call per field. Writes
+// of all streams go through a single ring, so the writes of a turn to
+// many clients take a few system calls instead of one each. A write
+// returns once its data is handed over, the next one waits for it to
+// be sent.
+class UringStream {
+public:
+  explicit UringStream(int fd);
+
+  // Waits for the last write, shut the socket down first to end it.
+  ~UringStream();
+
+  void read(void*, size_t);
+
+  // Takes the data over, leaving the emptied data of the previous
+  // write in its place. Throws if the previous write failed.
+  void write(std::vector<uint8_t>&);
+
+private:
+  static constexpr size_t READ_BUFFER = 65536;
+  int fd;
+  IoUring reader{2};
+  std::unique_ptr<uint8_t[]> data;
+  size_t begin{0}, end{0};
+  UringSend sending;
+};
+
+// Datagram socket sending to a single peer through io_uring. Datagrams
+// are received by one multishot request into buffers provided to the
+// kernel, each buffer is given back along with the next submission.
+class UringDatagram {
+public:
+  UringDatagram(int fd, const sockaddr*, socklen_t);
+  ~UringDatagram();
+
+  // Waits for the next datagram and returns its length.
+  size_t receive(void*, size_t);
+
+  void send(const uint8_t*, size_t);
+
+  // Makes the current and every later receive fail, may be called
+  // from any thread. Shutting a datagram socket down does not end
+  // requests in flight.
+  void cancel();
+
+private:
+  static constexpr unsigned BUFFERS = 8;
+  static constexpr size_t BUFFER_SIZE = 65536;
+  int fd, cancel_fd;
+  IoUring receiver{2 * BUFFERS}, sender{2};
+  sockaddr_storage peer;
+  socklen_t peer_length;
+  std::unique_ptr<uint8_t[]> buffers;
+  bool armed{false}, cancelled{false};
+
+  void provide(uint16_t first, uint16_t count);
+};
+
+#endif // URING_HPP
@@ -0,0 +1,60 @@
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "workers.hpp"
+
+WorkerPool::WorkerPool(size_t threads) {
+  for (size_t i = 1; i < threads; i++)
+    this->threads.emplace_back([this]{worker();});
+}
+
+WorkerPool::~WorkerPool() {
+  stopping = true;
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)> &body) {
+  if (threads.empty() || count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      body(i);
+    return;
+  }
+  this->body = &body;
+  this->count = count;
+  next.store(0, std::memory_order_relaxed);
+  pending.store(threads.size(), std::memory_order_relaxed);
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+
+  work();
+  // Wait until no thread touches the loop any more, so the next
+  // loop can be set up safely.
+  for (size_t left; (left = pending.load(std::memory_order_acquire)) != 0;)
+    pending.wait(left, std::memory_order_acquire);
+}
+
+void WorkerPool::work() {
+  for (;;) {
+    size_t i = next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= count)
+      break;
+    (*body)(i);
+  }
+}
+
+void WorkerPool::worker() {
+  uint32_t seen = 0;
+  for (;;) {
+    generation.wait(seen, std::memory_order_acquire);
+    seen = generation.load(std::memory_order_acquire);
+    if (stopping)
+      return;
+    work();
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      pending.notify_one();
+  }
+}
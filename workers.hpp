@@ -0,0 +1,44 @@
+#ifndef WORKERS_HPP
+#define WORKERS_HPP
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+// Fixed set of threads running loops whose iterations are independent.
+// Iterations are handed out one at a time, so uneven ones are balanced.
+class WorkerPool {
+public:
+  // The calling thread takes part in every loop, so `threads` counts
+  // it too and a pool of one thread starts no threads at all.
+  explicit WorkerPool(size_t threads);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  size_t size() const {
+    return threads.size() + 1;
+  }
+
+  // Calls `body` for every index in [0, count) and returns once all
+  // calls have finished. Only one thread may run loops at a time.
+  void run(size_t count, const std::function<void(size_t)> &body);
+
+private:
+  std::vector<std::thread> threads;
+  // Bumped to start a loop, the threads wait for it to change.
+  std::atomic<uint32_t> generation{0};
+  // Threads that have not finished the current loop yet.
+  std::atomic<size_t> pending{0};
+  std::atomic<size_t> next{0};
+  // Written before `generation` is bumped.
+  const std::function<void(size_t)> *body{nullptr};
+  size_t count{0};
+  bool stopping{false};
+
+  void work();
+  void worker();
+};
+
+#endif // WORKERS_HPP
@@ -0,0 +1,46 @@
+#ifndef ZOBRIST_HPP
+#define ZOBRIST_HPP
+#include <cstdint>
+
+// Zobrist hashing of the game state. Every element of the state (a
+// block, a robot at its position, a bomb, a player's score) has its own
+// pseudo-random key and the hash of the state is the XOR of the keys of
+// its elements, so adding or removing one element costs O(1). Keys are
+// computed with splitmix64 instead of being stored, boards may be big.
+// Server and client compute the same keys, so comparing their hashes
+// checks that they see the same board.
+namespace zobrist {
+  enum struct Kind : uint8_t {
+    Block = 1, Robot = 2, Bomb = 3, Score = 4
+  };
+
+  constexpr uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+
+  constexpr uint64_t key(Kind kind, uint32_t a, uint32_t b) {
+    return mix(mix((uint64_t) kind << 32 | a) ^ b);
+  }
+
+  constexpr uint64_t block(uint16_t x, uint16_t y) {
+    return key(Kind::Block, x, y);
+  }
+
+  constexpr uint64_t robot(uint8_t id, uint16_t x, uint16_t y) {
+    return key(Kind::Robot, id, (uint32_t) x << 16 | y);
+  }
+
+  constexpr uint64_t bomb(uint32_t id, uint16_t x, uint16_t y) {
+    return key(Kind::Bomb, id, (uint32_t) x << 16 | y);
+  }
+
+  // Zero scores are left out, so a new game starts from a zero hash.
+  constexpr uint64_t score(uint8_t id, uint32_t score) {
+    return score == 0 ? 0 : key(Kind::Score, id, score);
+  }
+} // namespace zobrist
+
+#endif // ZOBRIST_HPP